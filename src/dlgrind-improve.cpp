@@ -0,0 +1,114 @@
+#include <dlgrind/main.h>
+#include <dlgrind/schema.capnp.h>
+#include <dlgrind/improve.h>
+#include <dlgrind/rotation.h>
+#include <dlgrind/simulator.h>
+
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+class DLGrindImprove : DLGrind {
+public:
+  explicit DLGrindImprove(kj::ProcessContext& context)
+      : DLGrind(context) {}
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context_, "dlgrind-improve",
+        "Polish a rotation by local search, printing each better rotation found "
+        "until the time budget runs out")
+      .addOptionWithArg({'c', "config"}, KJ_BIND_METHOD(*this, setConfig),
+          "<filename>", "Read config from <filename>.")
+      .addOptionWithArg({"bundle"}, KJ_BIND_METHOD(*this, setBundle),
+          "<filename>", "Read config from a ConfigSet bundle (see get-config.py --bundle).")
+      .addOptionWithArg({"entry"}, KJ_BIND_METHOD(*this, setEntry),
+          "<name>", "Bundle entry to use, by name or index.")
+      .addOptionWithArg({"variant"}, KJ_BIND_METHOD(*this, setVariant),
+          "<name>", "Variant of the bundle entry to use.")
+      .addOptionWithArg({"skill-prep"}, KJ_BIND_METHOD(*this, setSkillPrep),
+          "<percent>", "Skill prep percentage (e.g., 75).")
+      .addOptionWithArg({"num-skills"}, KJ_BIND_METHOD(*this, setNumSkills),
+          "<number>", "Number of skills to consider (e.g. 2 or 3).")
+      .addOptionWithArg({"projectile-delay"}, KJ_BIND_METHOD(*this, setProjectileDelay),
+          "<frames>", "Frames of delay behind projectile cast and hit (enables precharge).")
+      .addOptionWithArg({"frames"}, KJ_BIND_METHOD(*this, setFrames),
+          "<frames>", "Rotations must take fewer than <frames> frames (default 3600).")
+      .addOptionWithArg({"seconds"}, KJ_BIND_METHOD(*this, setSeconds),
+          "<seconds>", "Time budget (default 10).")
+      .addOptionWithArg({"seed"}, KJ_BIND_METHOD(*this, setSeed),
+          "<number>", "Seed for the random restarts.")
+      .addOptionWithArg({"from"}, KJ_BIND_METHOD(*this, setFrom),
+          "<filename>", "Start from the last rotation in <filename> (e.g., logs/erik.log).")
+      .addOption({"perf-counters"}, KJ_BIND_METHOD(*this, setPerfCounters),
+          "Print hardware performance counters for each phase to stderr.")
+      .addOptionWithArg({"trace"}, KJ_BIND_METHOD(*this, setTrace),
+          "<filename>", "Write a Chrome trace-event timeline to <filename>.")
+      .expectZeroOrMoreArgs("<action>", KJ_BIND_METHOD(*this, setRotation))
+      .callAfterParsing(KJ_BIND_METHOD(*this, run))
+      .build();
+  }
+
+  kj::MainBuilder::Validity setNumSkills(kj::StringPtr num_skills) {
+    sim_.setNumSkills(num_skills.parseAs<size_t>());
+    return true;
+  }
+
+  kj::MainBuilder::Validity setFrames(kj::StringPtr frames) {
+    options_.horizon_ = frames.parseAs<uint32_t>();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setSeconds(kj::StringPtr seconds) {
+    options_.budget_ = std::chrono::milliseconds(
+        static_cast<int64_t>(seconds.parseAs<double>() * 1000));
+    return true;
+  }
+
+  kj::MainBuilder::Validity setSeed(kj::StringPtr seed) {
+    options_.seed_ = seed.parseAs<uint64_t>();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setFrom(kj::StringPtr from) {
+    std::ifstream is(from.cStr());
+    if (!is.good()) return "could not open rotation file";
+    std::string line;
+    std::optional<std::vector<Action>> last;
+    while (std::getline(is, line)) {
+      auto mb_rotation = parseRotation(line.c_str());
+      if (mb_rotation && !mb_rotation->empty()) last = std::move(mb_rotation);
+    }
+    if (!last) return "no rotation in file";
+    rotation_ = std::move(*last);
+    return true;
+  }
+
+  kj::MainBuilder::Validity setRotation(kj::StringPtr action) {
+    if (!parseActionToken(action, &rotation_)) {
+      return "unknown action";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    readConfig();
+    AdventurerState init = sim_.applyPrep(AdventurerState(), skill_prep_);
+
+    improveRotation(sim_, init, rotation_, perf_, [&](const Improvement& imp) {
+      std::cout << imp.rotation_ << "=> " << imp.dmg_ << " dmg in " << imp.frames_ << " frames"
+                << std::endl;
+    }, options_);
+
+    printPerfCounters();
+    writeTrace();
+
+    return true;
+  }
+
+private:
+  std::vector<Action> rotation_;
+  ImproveOptions options_;
+};
+
+KJ_MAIN(DLGrindImprove);
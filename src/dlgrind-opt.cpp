@@ -1,42 +1,18 @@
 #include <dlgrind/main.h>
 #include <dlgrind/schema.capnp.h>
-#include <dlgrind/hopcroft.h>
+#include <dlgrind/automaton.h>
 #include <dlgrind/simulator.h>
-#include <dlgrind/action_string.h>
+#include <dlgrind/optimizer.h>
+#include <dlgrind/rotation.h>
 
 #include <capnp/message.h>
 #include <capnp/serialize.h>
 
 #include <magic_enum.h>
 
-#include <unordered_map>
-#include <unordered_set>
 #include <vector>
 #include <optional>
 #include <iostream>
-#include <chrono>
-
-// Absolute tolerance when comparing DPS floating point for equality.
-constexpr double EPSILON = 0.01;
-
-namespace std {
-  template<typename T>
-  inline void hash_combine(std::size_t& seed, const T& val) {
-    std::hash<T> hasher;
-    seed ^= hasher(val) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-  }
-
-  // taken from https://stackoverflow.com/a/7222201/916549
-  template<typename S, typename T>
-  struct hash<std::pair<S, T>> {
-    inline size_t operator()(const std::pair<S, T>& val) const {
-      size_t seed = 0;
-      hash_combine(seed, val.first);
-      hash_combine(seed, val.second);
-      return seed;
-    }
-  };
-}
 
 // Return the index of an enum in magic_enum::enum_values
 template <typename T>
@@ -50,22 +26,6 @@ size_t enum_index(T val) {
 }
 
 
-using state_code_t = uint64_t;
-using action_code_t = uint8_t;
-using partition_t = uint32_t;
-
-using InverseMap = AdventurerStateMap<std::vector<std::pair<AdventurerState, Action>>>;
-
-struct StateCode {
-  AdventurerStateMap<state_code_t> encode_;
-  std::vector<AdventurerState> decode_;
-};
-
-struct ActionCode {
-  std::unordered_map<Action, action_code_t> encode_;
-  std::vector<Action> decode_;
-};
-
 class DLGrindOpt : DLGrind {
 public:
   explicit DLGrindOpt(kj::ProcessContext& context)
@@ -75,12 +35,58 @@ public:
         "Compute optimal rotations for characters in Dragalia Lost")
       .addOptionWithArg({'c', "config"}, KJ_BIND_METHOD(*this, setConfig),
           "<filename>", "Read config from <filename>.")
+      .addOptionWithArg({"bundle"}, KJ_BIND_METHOD(*this, setBundle),
+          "<filename>", "Read config from a ConfigSet bundle (see get-config.py --bundle).")
+      .addOptionWithArg({"entry"}, KJ_BIND_METHOD(*this, setEntry),
+          "<name>", "Bundle entry to use, by name or index.")
+      .addOptionWithArg({"variant"}, KJ_BIND_METHOD(*this, setVariant),
+          "<name>", "Variant of the bundle entry to use.")
       .addOptionWithArg({"skill-prep"}, KJ_BIND_METHOD(*this, setSkillPrep),
           "<percent>", "Skill prep percentage (e.g., 75).")
       .addOptionWithArg({"num-skills"}, KJ_BIND_METHOD(*this, setNumSkills),
           "<number>", "Number of skills to consider in optimization (e.g. 2 or 3).")
       .addOptionWithArg({"projectile-delay"}, KJ_BIND_METHOD(*this, setProjectileDelay),
           "<frames>", "Frames of delay behind projectile cast and hit (enables precharge).")
+      .addOptionWithArg({"timer-bucket"}, KJ_BIND_METHOD(*this, setTimerBucket),
+          "<frames>", "Approximate: track buff timers only to multiples of <frames>, "
+          "at most the shortest action (see --optimistic).")
+      .addOptionWithArg({"sp-tolerance"}, KJ_BIND_METHOD(*this, setSpTolerance),
+          "<sp>", "Approximate: merge states whose SP is at most <sp> short of a skill's "
+          "cost; at most the SP of the weakest hit (see --optimistic).")
+      .addOption({"optimistic"}, KJ_BIND_METHOD(*this, setOptimistic),
+          "Round bucketed timers and SP within --sp-tolerance up rather than down, so the "
+          "damage found is an upper rather than a lower bound.")
+      .addOption({"optimistic-timers"}, KJ_BIND_METHOD(*this, setOptimistic),
+          "Old name of --optimistic.")
+      .addOptionWithArg({"cache-dir"}, KJ_BIND_METHOD(*this, setCacheDir),
+          "<dir>", "Cache the minimized state machine in <dir>, keyed on the parts of "
+          "the config it depends on (so runs that only change damage reuse it).")
+      .addOption({"bounded-reachability"}, KJ_BIND_METHOD(*this, setBoundedReachability),
+          "Only build the state machine for what rotations shorter than <frames> can reach "
+          "(much smaller for short horizons; cached per horizon).")
+      .addOption({"macro-actions"}, KJ_BIND_METHOD(*this, setMacroActions),
+          "Build the state machine over whole combos (c1 ... c5fs), fs and skills rather "
+          "than single hits: fewer states and edges for the DP, same rotations.")
+      .addOption({"on-the-fly"}, KJ_BIND_METHOD(*this, setOnTheFly),
+          "Minimize the state machine without storing its unminimized transitions "
+          "(slower, but needs far less memory).")
+      .addOptionWithArg({"engine"}, KJ_BIND_METHOD(*this, setEngine),
+          "<engine>", "DP engine: dense (default) visits every state at every frame; "
+          "sparse only visits states something reachable leads to; forward skips building "
+          "the state machine (the default up to 1800 frames); beam is forward, but only "
+          "expanding the most promising states of each frame (see --beam-width); sharded is "
+          "dense, split over one process per NUMA node (see --shards).")
+      .addOptionWithArg({"beam-width"}, KJ_BIND_METHOD(*this, setBeamWidth),
+          "<number>", "States expanded per frame by --engine beam (default 16384).")
+      .addOptionWithArg({"shards"}, KJ_BIND_METHOD(*this, setShards),
+          "<number>", "Worker processes for --engine sharded (default: one per NUMA node).")
+      .addOptionWithArg({"tick"}, KJ_BIND_METHOD(*this, setTick),
+          "<frames>", "Approximate: round action lengths down to multiples of <frames>, "
+          "then re-simulate the rotations found and report the gap to the optimum.")
+      .addOption({"perf-counters"}, KJ_BIND_METHOD(*this, setPerfCounters),
+          "Print hardware performance counters for each phase to stderr.")
+      .addOptionWithArg({"trace"}, KJ_BIND_METHOD(*this, setTrace),
+          "<filename>", "Write a Chrome trace-event timeline to <filename>.")
       .expectOptionalArg("<frames>", KJ_BIND_METHOD(*this, setFrames))
       .callAfterParsing(KJ_BIND_METHOD(*this, run))
       .build();
@@ -91,320 +97,189 @@ public:
     return true;
   }
 
-  kj::MainBuilder::Validity setNumSkills(kj::StringPtr num_skills) {
-    sim_.setNumSkills(num_skills.parseAs<size_t>());
+  kj::MainBuilder::Validity setCacheDir(kj::StringPtr dir) {
+    cacheDir_ = dir;
     return true;
   }
 
-  kj::MainBuilder::Validity run() {
-    readConfig();
-
-    // apply skill prep
-    init_state_ = sim_.applyPrep(init_state_, skill_prep_);
-
-    ActionCode action_code;
-
-    PackedInverse inverse;
-    std::vector<AdventurerState> partition_reps;
-    uint32_t numPartitions;
-    partition_t initialPartition;
-    {
-      StateCode state_code;
-      HopcroftInput hopcroft_input;
-      {
-        auto [ inverse_map, inverse_size ] = computeReachableStates();
-        std::tie(state_code, action_code) = numberStatesAndActions(inverse_map);
-
-        // Minimize states
-        {
-          hopcroft_input.setNumStates(state_code.decode_.size());
-          hopcroft_input.setNumActions(action_code.decode_.size());
+  kj::MainBuilder::Validity setBoundedReachability() {
+    boundedReachability_ = true;
+    return true;
+  }
 
-          {
-            auto& inverse = hopcroft_input.initInverse();
-            auto states = inverse.initStates(inverse_size);
-            auto actions = inverse.initActions(inverse_size);
-            auto index = inverse.initIndex(state_code.decode_.size() + 1);
-            size_t inverse_index = 0;
-            for (state_code_t i = 0; i < state_code.decode_.size(); i++) {
-              index[i] = inverse_index;
-              for (const auto& sa : inverse_map[state_code.decode_[i]]) {
-                state_code_t s_code = state_code.encode_[sa.first];
-                action_code_t a_code = action_code.encode_[sa.second];
-                states[inverse_index] = s_code;
-                actions[inverse_index] = a_code;
-                inverse_index++;
-              }
-            }
-            KJ_ASSERT(inverse_index == inverse_size, inverse_index, inverse_size);
-            index[state_code.decode_.size()] = inverse_index;
-          }
+  kj::MainBuilder::Validity setMacroActions() {
+    automatonOptions_.macroActions_ = true;
+    return true;
+  }
 
-          auto initialPartition = hopcroft_input.initInitialPartition(state_code.decode_.size());
-          AdventurerStateMap<partition_t> partition_map;
-          for (state_code_t i = 0; i < state_code.decode_.size(); i++) {
-            AdventurerState s = state_code.decode_[i];
-            // coarsen the state
-            for (size_t i = 0; i < 3; i++) {
-              s.sp_[i] = 0;
-              s.energy_ = s.energy_ == 5;
-              s.buffFramesLeft_[i] = s.buffFramesLeft_[i] != 0;
-            }
-            auto it = partition_map.find(s);
-            partition_t v;
-            if (it == partition_map.end()) {
-              v = partition_map.size();
-              partition_map.emplace(s, v);
-            } else {
-              v = it->second;
-            }
-            initialPartition[i] = v;
-          }
-          KJ_LOG(INFO, partition_map.size(), "initial number of partitions");
-        }
-      }
-      HopcroftOutput hopcroft_output;
-      hopcroft(hopcroft_input, &hopcroft_output);
-      auto partition = hopcroft_output.getPartition();
-      numPartitions = hopcroft_output.getNumPartitions();
-      initialPartition = partition[state_code.encode_[init_state_]];
+  kj::MainBuilder::Validity setOnTheFly() {
+    automatonOptions_.onTheFly_ = true;
+    return true;
+  }
 
-      // Redo inverse transition table for partitions
-      {
-        // Compute it first with shitty data structures.
-        // Even if states are equivalent, the states that feed to them
-        // may not be: equivalence is a statement about future
-        // evolution, not the past!
-        std::unordered_map<partition_t, std::unordered_set<std::pair<partition_t, action_code_t>>> inverse_map;
-        const auto& old_inverse = hopcroft_input.getInverse();
-        auto old_states = old_inverse.getStates();
-        auto old_actions = old_inverse.getActions();
-        auto old_index = old_inverse.getIndex();
-        size_t inverse_size = 0;
-        partition_reps.resize(numPartitions);
-        for (state_code_t s = 0; s < state_code.decode_.size(); s++) {
-          partition_t p = partition[s];
-          partition_reps[p] = state_code.decode_[s];  // last one wins
-          for (uint32_t i = old_index[s]; i < old_index[s+1]; i++) {
-            std::pair<partition_t, action_code_t> pair = {
-              partition[old_states[i]],
-              old_actions[i]
-            };
-            auto r = inverse_map[p].emplace(pair);
-            if (r.second) {
-              inverse_size++;
-            }
-          }
-        }
+  kj::MainBuilder::Validity setEngine(kj::StringPtr name) {
+    auto engine = parseOptimizerEngine(name);
+    if (!engine) return "unknown engine";
+    options_.engine_ = *engine;
+    engineSet_ = true;
+    return true;
+  }
 
-        // Pack the map now
-        auto states = inverse.initStates(inverse_size);
-        auto actions = inverse.initActions(inverse_size);
-        auto index = inverse.initIndex(numPartitions + 1);
-        size_t inverse_index = 0;
-        for (partition_t i = 0; i < numPartitions; i++) {
-          index[i] = inverse_index;
-          for (const auto& pa : inverse_map[i]) {
-            states[inverse_index] = pa.first;
-            actions[inverse_index] = pa.second;
-            inverse_index++;
-          }
-        }
-        KJ_ASSERT(inverse_index == inverse_size, inverse_index, inverse_size);
-        KJ_LOG(INFO, inverse_size, "reduced inverse transition matrix");
-        index[numPartitions] = inverse_index;
-      }
-    }
+  kj::MainBuilder::Validity setBeamWidth(kj::StringPtr width) {
+    options_.beamWidth_ = width.parseAs<size_t>();
+    if (options_.beamWidth_ == 0) return "beam width must be positive";
+    return true;
+  }
 
-    auto inverse_states = inverse.getStates();
-    auto inverse_actions = inverse.getActions();
-    auto inverse_index = inverse.getIndex();
+  kj::MainBuilder::Validity setShards(kj::StringPtr shards) {
+    options_.shards_ = shards.parseAs<size_t>();
+    if (options_.shards_ == 0) return "shards must be positive";
+    return true;
+  }
 
-    // Compute necessary frame window
-    frames_t max_frames = 1;
-    for (partition_t p = 0; p < numPartitions; p++) {
-      for (size_t i = inverse_index[p]; i < inverse_index[p+1]; i++) {
-        auto prev = partition_reps[inverse_states[i]];
-        auto a = action_code.decode_[inverse_actions[i]];
-        frames_t frames = sim_.computeFrames(prev, a);
-        if (frames > max_frames) {
-          max_frames = frames + 1;
-        }
-      }
-    }
+  kj::MainBuilder::Validity setTick(kj::StringPtr tick) {
+    options_.tick_ = tick.parseAs<uint32_t>();
+    if (options_.tick_ == 0) return "tick must be positive";
+    return true;
+  }
 
-    int buffer_size = max_frames * numPartitions;
-    std::vector<float> best_dps(buffer_size, -1);
-    std::vector<ActionString> best_sequence(buffer_size);
+  kj::MainBuilder::Validity setTimerBucket(kj::StringPtr frames) {
+    timerBucket_ = frames.parseAs<uint32_t>();
+    if (timerBucket_ == 0) return "timer bucket must be positive";
+    return true;
+  }
 
-    auto dix = [&](int frame, int state_ix) {
-      return (frame % max_frames) * numPartitions + state_ix;
-    };
+  kj::MainBuilder::Validity setSpTolerance(kj::StringPtr sp) {
+    spTolerance_ = sp.parseAs<uint16_t>();
+    return true;
+  }
 
-    best_dps[dix(0, initialPartition)] = 0;
+  kj::MainBuilder::Validity setOptimistic() {
+    rounding_ = ApproxRounding::OPTIMISTIC;
+    return true;
+  }
 
-    auto start_time = std::chrono::high_resolution_clock::now();
-    auto last_print_time = start_time;
+  kj::MainBuilder::Validity setNumSkills(kj::StringPtr num_skills) {
+    sim_.setNumSkills(num_skills.parseAs<size_t>());
+    return true;
+  }
 
-    float last_best = 0;
-    // This is the bottleneck!
-    //  - Snapshotting (so I can continue computing later)
-    //  - More state reduction?
-    //    - Unsound approximations; e.g., quantize buff / SP time
-    //  - Branch bound (we KNOW that this is provably worse,
-    //    prune it)
-    //    - Same combo, same buff, dps is less, SP is less
-    //    - Best case "catch up" for states
-    //    - Problem: How to know you've been dominated?  Not so easy
-    //      to tell without more scanning.
-    //  - [TODO] Improve locality of access?
-    //    - Only five actions: bucket them together
-    //    - Lay out action_inverses contiguously, so we don't
-    //      thrash cache
-    //  - Parallelize/Vectorize...
-    //    - ...computation of all incoming actions (no
-    //      data dependency, reduction at the end)
-    //    - ...computation of all states at the same
-    //      frame (no data dependency, reduction at the end)
-    //    - ...all frames within the minimum frame window
-    //      (provably no data dependency.)
-    //  - Small optimizations
-    //    - Compute best as we go (in the main loop), rather
-    //      than another single loop at the end
-    for (int f = 1; f < frames_; f++) {
-      auto cur_time = std::chrono::high_resolution_clock::now();
-      if (cur_time > last_print_time + 1 * std::chrono::seconds(60)) {
-        std::cerr << "fpm: " << (f * std::chrono::minutes(1)) / (cur_time - start_time) << "\n";
-        last_print_time = cur_time;
-      }
-      #pragma omp parallel for
-      for (int p = 0; p < numPartitions; p++) {
-        auto& cur = best_dps[dix(f, p)];
-        auto& cur_seq = best_sequence[dix(f, p)];
+  kj::MainBuilder::Validity run() {
+    sim_.setApproxRounding(rounding_);
+    sim_.setTimerBucket(timerBucket_);
+    sim_.setSpTolerance(spTolerance_);
+    readConfig();
 
-        // Consider all states which could have lead here
-        for (int j = inverse_index[p]; j < inverse_index[p+1]; j++) {
-          partition_t prev_p = inverse_states[j];
-          AdventurerState prev = partition_reps[prev_p];
-          Action a = action_code.decode_[inverse_actions[j]];
+    // apply skill prep
+    init_state_ = sim_.applyPrep(init_state_, skill_prep_);
 
-          frames_t frames;
-          double dmg;
-          auto r = sim_.applyAction(prev, a, &frames, &dmg);
-          KJ_ASSERT(!!r);
+    // Short horizons default to the forward engine, unless something
+    // asked for the automaton
+    if (!engineSet_ && frames_ <= FORWARD_MAX_HORIZON && options_.tick_ == 1 &&
+        !wantsAutomaton()) {
+      options_.engine_ = OptimizerEngine::FORWARD;
+    }
+    KJ_LOG(INFO, std::string(magic_enum::enum_name(options_.engine_)), engineSet_, "optimizer engine");
+    bool forward = options_.engine_ == OptimizerEngine::FORWARD ||
+      options_.engine_ == OptimizerEngine::BEAM;
+    if (forward && wantsAutomaton()) {
+      return "--cache-dir, --bounded-reachability, --macro-actions and --on-the-fly "
+        "need an engine that builds the state machine";
+    }
 
-          if (f >= frames) {
-            auto z = dix(f - frames, prev_p);
-            if (best_dps[z] >= 0) {
-              auto tmp = best_dps[z] + dmg;
-              if (tmp >= 0 && tmp > cur + EPSILON) {
-                cur = tmp;
-                cur_seq = best_sequence[z];
-                cur_seq.push(a);
-              } else if (tmp >= 0 && tmp > cur - EPSILON) {
-                ActionString tmp_seq = best_sequence[z];
-                tmp_seq.push(a);
-                // The idea here is that there are often moves which
-                // have transpositions (end up with the same dps and
-                // end state); let's define an ordering on our move
-                // set and prefer moves that frontload combos to make
-                // the chosen combos deterministic.  This helps in
-                // testing.
-                if (std::lexicographical_compare(
-                      cur_seq.buffer_.begin(), cur_seq.buffer_.end(),
-                      tmp_seq.buffer_.begin(), tmp_seq.buffer_.end())) {
-                  cur = tmp;
-                  cur_seq = std::move(tmp_seq);
-                }
-              }
-            }
-          }
-        }
+    std::optional<Improvement> best;
+    // With a tick: the best exact rotation that fits, and the coarse
+    // DP's bound
+    float tick_lower = 0;
+    float tick_upper = 0;
+    auto print = [&](const Improvement& imp) {
+      best = imp;
+      if (options_.tick_ > 1) {
+        tick_upper = imp.boundDmg_;
+        if (imp.frames_ < frames_ && imp.dmg_ > tick_lower) tick_lower = imp.dmg_;
       }
-      float best = -1;
-      int best_index = -1;
-      int density = 0;
-      for (int p = 0; p < numPartitions; p++) {
-        auto tmp = best_dps[dix(f, p)];
-        if (tmp > best + EPSILON) {
-          best = tmp;
-          best_index = dix(f, p);
-        }
-        if (tmp > 0) {
-          density++;
-        }
-      }
-      if (best >= 0) {
-        if (best >= 0 && best > last_best + EPSILON) {
-          std::cout << best_sequence[best_index];
-          std::cout << "=> " << best << " dmg in " << f << " frames\n";
-          last_best = best;
-        }
+      std::cout << imp.rotation_ << "=> " << imp.dmg_ << " dmg in " << imp.frames_ << " frames";
+      if (options_.tick_ > 1) {
+        std::cout << " (at most " << imp.boundDmg_ << " dmg under " << imp.boundFrames_ << " frames)";
       }
+      std::cout << "\n";
+    };
+    if (forward) {
+      optimizeRotationForward(sim_, init_state_, frames_, perf_, print, options_);
+    } else {
+      if (boundedReachability_) automatonOptions_.horizon_ = frames_;
+      Automaton automaton = loadOrBuildAutomaton(
+          sim_, init_state_, cacheDir_, perf_, automatonOptions_);
+      optimizeRotation(sim_, automaton, frames_, perf_, print, options_);
     }
+    if (options_.tick_ > 1) {
+      std::cout << "tick " << options_.tick_ << ": the optimum in " << frames_
+                << " frames does between " << tick_lower << " and " << tick_upper
+                << " dmg (gap " << tick_upper - tick_lower << ")\n";
+    }
+    if (best && sim_.approximate()) printExact(*best);
 
-    auto cur_time = std::chrono::high_resolution_clock::now();
-    std::cerr << "fpm: " << (frames_ * std::chrono::minutes(1)) / (cur_time - start_time) << "\n";
+    printPerfCounters();
+    writeTrace();
 
     return true;
   }
 
 private:
-
-  // returns inverse_map, inverse_size (number of transitions)
-  std::pair<InverseMap, size_t> computeReachableStates() {
-    // Compute reachable states
-    InverseMap inverse_map;
-    size_t inverse_size = 0;
-    {
-      std::vector<AdventurerState> todo{init_state_};
-      inverse_map[init_state_];
-      while (todo.size()) {
-        auto s = todo.back();
-        //KJ_LOG(INFO, s, "loop");
-        //std::cout << kj::str(s).cStr() << "\n";
-        todo.pop_back();
-        auto push = [&](AdventurerState n_s, Action a) {
-          if (inverse_map.count(n_s) == 0) {
-            todo.emplace_back(n_s);
-          }
-          inverse_map[n_s].emplace_back(s, a);
-          inverse_size++;
-        };
-        for (auto a : magic_enum::enum_values<Action>()) {
-          auto mb_n_s = sim_.applyAction(s, a);
-          if (mb_n_s) {
-            push(*mb_n_s, a);
-          }
-        }
-      }
-    }
-    KJ_LOG(INFO, inverse_map.size(), "initial states");
-    return {inverse_map, inverse_size};
+  // Whether an option that only the automaton engines use was given
+  bool wantsAutomaton() const {
+    return cacheDir_ || boundedReachability_ || automatonOptions_.macroActions_ ||
+      automatonOptions_.onTheFly_;
   }
 
-  std::pair<StateCode, ActionCode> numberStatesAndActions(const InverseMap& inverse_map) {
-
-    StateCode state_code;
-    ActionCode action_code;
-
-    // Number states
-    for (const auto& kv : inverse_map) {
-      state_code.encode_.emplace(kv.first, state_code.decode_.size());
-      state_code.decode_.emplace_back(kv.first);
-    }
-
-    // Number actions
-    for (auto val : magic_enum::enum_values<Action>()) {
-      action_code.encode_.emplace(val, action_code.decode_.size());
-      action_code.decode_.emplace_back(val);
+  // With merged states, the damage found is only a bound: re-simulate
+  // the best rotation without the approximation for the other side.
+  // Both approximations are monotone (the simulator checks the bucket
+  // and tolerance are small enough for that), buffs only help and more
+  // SP only allows more, so the conservative model is a lower bound
+  // and the optimistic one an upper bound; without those, only the
+  // exact re-simulation would mean anything.  The beam prunes, so what
+  // it finds bounds nothing either.
+  void printExact(const Improvement& best) {
+    bool optimistic = rounding_ == ApproxRounding::OPTIMISTIC &&
+      options_.engine_ != OptimizerEngine::BEAM;
+    // With a tick, dmg_ is already a re-simulation (of the merged
+    // states), and the DP's own value is the bound
+    float bound = options_.tick_ > 1 ? best.boundDmg_ : best.dmg_;
+    sim_.setTimerBucket(1);
+    sim_.setSpTolerance(0);
+    auto rotation = parseRotation(best.rotation_.c_str());
+    KJ_ASSERT(!!rotation, best.rotation_);
+    auto r = simulateRotations(sim_, init_state_, {std::move(*rotation)})[0];
+    if (!r.valid_) {
+      // Only possible when optimistic: a skill was ready early
+      std::cout << "exact: illegal at action " << r.failedAt_;
+      if (optimistic) std::cout << "; the optimum is at most " << bound << " dmg";
+      std::cout << "\n";
+    } else if (optimistic) {
+      std::cout << "exact: " << r.dmg_ << " dmg in " << r.frames_
+                << " frames; the optimum is between that and " << bound
+                << " dmg (gap " << bound - r.dmg_ << ")\n";
+    } else {
+      std::cout << "exact: " << r.dmg_ << " dmg in " << r.frames_
+                << " frames; the optimum is at least that";
+      if (options_.engine_ != OptimizerEngine::BEAM) {
+        std::cout << " (run with --optimistic for an upper bound)";
+      }
+      std::cout << "\n";
     }
-
-    return { std::move(state_code), std::move(action_code) };
   }
 
   frames_t frames_ = 3600;
   AdventurerState init_state_;
+  std::optional<kj::StringPtr> cacheDir_;
+  bool boundedReachability_ = false;
+  AutomatonOptions automatonOptions_;
+  OptimizerOptions options_;
+  bool engineSet_ = false;
+  frames_t timerBucket_ = 1;
+  ApproxRounding rounding_ = ApproxRounding::CONSERVATIVE;
+  uint16_t spTolerance_ = 0;
 
 };
 
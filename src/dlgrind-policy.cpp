@@ -0,0 +1,124 @@
+#include <dlgrind/main.h>
+#include <dlgrind/schema.capnp.h>
+#include <dlgrind/automaton.h>
+#include <dlgrind/policy.h>
+#include <dlgrind/rotation.h>
+#include <dlgrind/simulator.h>
+
+#include <iostream>
+#include <optional>
+#include <vector>
+
+class DLGrindPolicy : DLGrind {
+public:
+  explicit DLGrindPolicy(kj::ProcessContext& context)
+      : DLGrind(context) {}
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context_, "dlgrind-policy",
+        "Build a table of the best next action from every reachable state and "
+        "number of frames left, or look up the best next action after a rotation")
+      .addOptionWithArg({'c', "config"}, KJ_BIND_METHOD(*this, setConfig),
+          "<filename>", "Read config from <filename>.")
+      .addOptionWithArg({"bundle"}, KJ_BIND_METHOD(*this, setBundle),
+          "<filename>", "Read config from a ConfigSet bundle (see get-config.py --bundle).")
+      .addOptionWithArg({"entry"}, KJ_BIND_METHOD(*this, setEntry),
+          "<name>", "Bundle entry to use, by name or index.")
+      .addOptionWithArg({"variant"}, KJ_BIND_METHOD(*this, setVariant),
+          "<name>", "Variant of the bundle entry to use.")
+      .addOptionWithArg({"skill-prep"}, KJ_BIND_METHOD(*this, setSkillPrep),
+          "<percent>", "Skill prep percentage (e.g., 75).")
+      .addOptionWithArg({"num-skills"}, KJ_BIND_METHOD(*this, setNumSkills),
+          "<number>", "Number of skills to consider (e.g. 2 or 3).")
+      .addOptionWithArg({"projectile-delay"}, KJ_BIND_METHOD(*this, setProjectileDelay),
+          "<frames>", "Frames of delay behind projectile cast and hit (enables precharge).")
+      .addOptionWithArg({"build"}, KJ_BIND_METHOD(*this, setBuild),
+          "<frames>", "Build the table for up to <frames> frames left and write it to <policy>.")
+      .addOptionWithArg({"frames-left"}, KJ_BIND_METHOD(*this, setFramesLeft),
+          "<frames>", "Frames left in the fight after the rotation (for lookups).")
+      .addOption({"perf-counters"}, KJ_BIND_METHOD(*this, setPerfCounters),
+          "Print hardware performance counters for each phase to stderr.")
+      .addOptionWithArg({"trace"}, KJ_BIND_METHOD(*this, setTrace),
+          "<filename>", "Write a Chrome trace-event timeline to <filename>.")
+      .expectArg("<policy>", KJ_BIND_METHOD(*this, setPolicy))
+      .expectZeroOrMoreArgs("<action>", KJ_BIND_METHOD(*this, setRotation))
+      .callAfterParsing(KJ_BIND_METHOD(*this, run))
+      .build();
+  }
+
+  kj::MainBuilder::Validity setNumSkills(kj::StringPtr num_skills) {
+    sim_.setNumSkills(num_skills.parseAs<size_t>());
+    return true;
+  }
+
+  kj::MainBuilder::Validity setBuild(kj::StringPtr frames) {
+    build_ = frames.parseAs<uint32_t>();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setFramesLeft(kj::StringPtr frames) {
+    framesLeft_ = frames.parseAs<uint32_t>();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setPolicy(kj::StringPtr policy) {
+    policy_ = policy;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setRotation(kj::StringPtr action) {
+    if (!parseActionToken(action, &rotation_)) {
+      return "unknown action";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    if (!build_ && !framesLeft_) {
+      return "expected --build or --frames-left";
+    }
+    readConfig();
+    AdventurerState init = sim_.applyPrep(AdventurerState(), skill_prep_);
+
+    if (build_) {
+      PackedStateMap<partition_t> state_partition;
+      Automaton automaton = buildAutomaton(sim_, init, perf_, &state_partition);
+      auto table = buildPolicyTable(sim_, automaton, state_partition, *build_, perf_);
+      writePolicyTable(policy_, policyFingerprint(sim_, init), table);
+    } else {
+      auto mb_table = loadPolicyTable(policy_, policyFingerprint(sim_, init));
+      if (!mb_table) return "policy file does not match this config";
+      if (*framesLeft_ >= mb_table->horizon()) return "--frames-left is beyond the policy's horizon";
+
+      AdventurerState st = init;
+      for (size_t i = 0; i < rotation_.size(); i++) {
+        auto mb_st = sim_.applyAction(st, rotation_[i]);
+        if (!mb_st) {
+          std::cout << "illegal action " << i << "\n";
+          return true;
+        }
+        st = *mb_st;
+      }
+      auto mb_move = mb_table->query(sim_.layout(), st, *framesLeft_);
+      if (!mb_move) {
+        std::cout << "unreachable state\n";
+      } else if (!mb_move->action_) {
+        std::cout << "nothing fits => " << mb_move->dmg_ << " dmg to go\n";
+      } else {
+        std::cout << kj::str(*mb_move->action_).cStr() << " => " << mb_move->dmg_ << " dmg to go\n";
+      }
+    }
+
+    printPerfCounters();
+    writeTrace();
+
+    return true;
+  }
+
+private:
+  std::optional<frames_t> build_;
+  std::optional<frames_t> framesLeft_;
+  kj::StringPtr policy_;
+  std::vector<Action> rotation_;
+};
+
+KJ_MAIN(DLGrindPolicy);
@@ -1,6 +1,7 @@
 #include <dlgrind/main.h>
 #include <dlgrind/schema.capnp.h>
 #include <dlgrind/hopcroft.h>
+#include <dlgrind/rotation.h>
 #include <dlgrind/simulator.h>
 
 #include <capnp/message.h>
@@ -8,7 +9,10 @@
 
 #include <magic_enum.h>
 
+#include <cctype>
+#include <fstream>
 #include <iostream>
+#include <string>
 #include <unordered_map>
 #include <vector>
 #include <optional>
@@ -22,72 +26,138 @@ public:
         "Simulate a fixed rotation, computing frame count")
       .addOptionWithArg({'c', "config"}, KJ_BIND_METHOD(*this, setConfig),
           "<filename>", "Read config from <filename>.")
+      .addOptionWithArg({"bundle"}, KJ_BIND_METHOD(*this, setBundle),
+          "<filename>", "Read config from a ConfigSet bundle (see get-config.py --bundle).")
+      .addOptionWithArg({"entry"}, KJ_BIND_METHOD(*this, setEntry),
+          "<name>", "Bundle entry to use, by name or index.")
+      .addOptionWithArg({"variant"}, KJ_BIND_METHOD(*this, setVariant),
+          "<name>", "Variant of the bundle entry to use.")
       .addOptionWithArg({"skill-prep"}, KJ_BIND_METHOD(*this, setSkillPrep),
           "<percent>", "Skill prep percentage (e.g., 75).")
       .addOptionWithArg({"projectile-delay"}, KJ_BIND_METHOD(*this, setProjectileDelay),
           "<frames>", "Frames of delay behind projectile cast and hit (enables precharge).")
-      .expectOneOrMoreArgs("<rotation>", KJ_BIND_METHOD(*this, setRotation))
+      .addOption({"perf-counters"}, KJ_BIND_METHOD(*this, setPerfCounters),
+          "Print hardware performance counters for each phase to stderr.")
+      .addOptionWithArg({"trace"}, KJ_BIND_METHOD(*this, setTrace),
+          "<filename>", "Write a Chrome trace-event timeline to <filename>.")
+      .addOptionWithArg({"batch"}, KJ_BIND_METHOD(*this, setBatch),
+          "<filename>", "Simulate every rotation in <filename> (- for stdin), one per line, "
+          "printing one result line each.  Lines of dlgrind-opt output are accepted.")
+      .expectZeroOrMoreArgs("<rotation>", KJ_BIND_METHOD(*this, setRotation))
       .callAfterParsing(KJ_BIND_METHOD(*this, run))
       .build();
   }
 
   kj::MainBuilder::Validity setRotation(kj::StringPtr action) {
-    if (action == "fs") {
-      rotation_.emplace_back(Action::FS);
-    } else if (action == "x") {
-      rotation_.emplace_back(Action::X);
-    } else if (action == "s1") {
-      rotation_.emplace_back(Action::S1);
-    } else if (action == "s2") {
-      rotation_.emplace_back(Action::S2);
-    } else if (action == "s3") {
-      rotation_.emplace_back(Action::S3);
-    } else if (action.startsWith("c")) {
-      bool fs;
-      uint8_t count;
-      if (action.endsWith("fs")) {
-        fs = true;
-        count = heapString(action.slice(1, action.size()-2)).parseAs<uint8_t>();
-      } else {
-        fs = false;
-        count = action.slice(1).parseAs<uint8_t>();
-      }
-      for (uint8_t i = 0; i < count; i++) {
-        rotation_.emplace_back(Action::X);
-      }
-      if (fs) {
-        rotation_.emplace_back(Action::FS);
-      }
+    if (!parseActionToken(action, &rotation_)) {
+      return "unknown action";
     }
     return true;
   }
 
+  kj::MainBuilder::Validity setBatch(kj::StringPtr batch_fn) {
+    batchFile_ = batch_fn;
+    return true;
+  }
+
   kj::MainBuilder::Validity run() {
+    if (batchFile_) {
+      if (*batchFile_ == "-" && !configFile_ && !bundleFile_) {
+        return "cannot read both config and --batch from stdin";
+      }
+      readConfig();
+      runBatch();
+      printPerfCounters();
+      writeTrace();
+      return true;
+    }
+    if (rotation_.empty()) {
+      return "expected a rotation (or --batch)";
+    }
+
     readConfig();
 
     frames_t frames = 0;
     double dmg = 0;
-    AdventurerState st;
-    st = sim_.applyPrep(st, skill_prep_);
-    for (auto a : rotation_) {
-      frames_t step_frames;
-      double step_dmg;
-      auto mb_st = sim_.applyAction(st, a, &step_frames, &step_dmg);
-      frames += step_frames;
-      dmg += step_dmg;
-      KJ_ASSERT(!!mb_st);
-      st = *mb_st;
-      float time = static_cast<float>(frames) / 60;
-      std::cerr << time << " " << kj::str(a).cStr() << " " << step_dmg << " " << kj::str(st).cStr() << "\n";
+    {
+      auto perf = perf_.phase("simulate");
+      TraceSpan trace("simulate");
+      AdventurerState st;
+      st = sim_.applyPrep(st, skill_prep_);
+      for (auto a : rotation_) {
+        frames_t step_frames;
+        double step_dmg;
+        auto mb_st = sim_.applyAction(st, a, &step_frames, &step_dmg);
+        frames += step_frames;
+        dmg += step_dmg;
+        KJ_ASSERT(!!mb_st);
+        st = *mb_st;
+        float time = static_cast<float>(frames) / 60;
+        std::cerr << time << " " << kj::str(a).cStr() << " " << step_dmg << " " << kj::str(st).cStr() << "\n";
+      }
     }
 
     std::cout << dmg << "\n";
 
+    printPerfCounters();
+    writeTrace();
+
     return true;
   }
 
 private:
+  void runBatch() {
+    std::vector<std::string> lines;
+    std::vector<std::vector<Action>> rotations;
+    {
+      auto perf = perf_.phase("parse");
+      TraceSpan trace("parse");
+      std::ifstream file;
+      std::istream* is = &std::cin;
+      if (*batchFile_ != "-") {
+        file.open(batchFile_->cStr());
+        KJ_REQUIRE(file.good(), *batchFile_, "could not open batch file");
+        is = &file;
+      }
+      std::string line;
+      while (std::getline(*is, line)) {
+        auto mb_rotation = parseRotation(line.c_str());
+        if (!mb_rotation) {
+          KJ_LOG(WARNING, line, "skipping unparseable rotation");
+          continue;
+        }
+        if (mb_rotation->empty()) continue;
+        // Echo the rotation as given, without any old result
+        auto arrow = line.find("=>");
+        if (arrow != std::string::npos) line.resize(arrow);
+        while (!line.empty() && isspace(line.back())) line.pop_back();
+        lines.emplace_back(std::move(line));
+        rotations.emplace_back(std::move(*mb_rotation));
+      }
+    }
+
+    std::vector<RotationResult> results;
+    {
+      auto perf = perf_.phase("simulate");
+      AdventurerState st;
+      st = sim_.applyPrep(st, skill_prep_);
+      results = simulateRotations(sim_, st, rotations);
+    }
+
+    // Same format as dlgrind-opt, so results can be diffed against logs
+    for (size_t i = 0; i < results.size(); i++) {
+      const auto& r = results[i];
+      std::cout << lines[i] << " => ";
+      if (r.valid_) {
+        std::cout << r.dmg_ << " dmg in " << r.frames_ << " frames\n";
+      } else {
+        std::cout << "illegal action " << r.failedAt_ << "\n";
+      }
+    }
+  }
+
   std::vector<Action> rotation_;
+  std::optional<kj::StringPtr> batchFile_;
 };
 
 KJ_MAIN(DLGrindRotation);
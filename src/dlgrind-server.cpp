@@ -0,0 +1,208 @@
+#include <dlgrind/main.h>
+#include <dlgrind/schema.capnp.h>
+#include <dlgrind/server.capnp.h>
+#include <dlgrind/automaton.h>
+#include <dlgrind/fingerprint.h>
+#include <dlgrind/optimizer.h>
+#include <dlgrind/rotation.h>
+#include <dlgrind/simulator.h>
+
+#include <capnp/ez-rpc.h>
+#include <capnp/message.h>
+
+#include <list>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// At most capacity values, keyed on fingerprints; the least recently
+// used goes first
+template <typename T>
+class LruCache {
+public:
+  explicit LruCache(size_t capacity) : capacity_(capacity) {}
+
+  // nullptr if absent; otherwise it is now the most recently used
+  T* find(uint64_t key) {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->first == key) {
+        entries_.splice(entries_.begin(), entries_, it);
+        return &entries_.front().second;
+      }
+    }
+    return nullptr;
+  }
+
+  T& insert(uint64_t key, T value) {
+    if (T* v = find(key)) {
+      *v = std::move(value);
+      return *v;
+    }
+    entries_.emplace_front(key, std::move(value));
+    if (entries_.size() > capacity_) entries_.pop_back();
+    return entries_.front().second;
+  }
+
+private:
+  size_t capacity_;
+  std::list<std::pair<uint64_t, T>> entries_;
+};
+
+class OptimizerImpl final : public Optimizer::Server {
+public:
+  OptimizerImpl(std::optional<kj::StringPtr> cache_dir, size_t max_entries)
+      : cacheDir_(cache_dir), automata_(max_entries), results_(max_entries) {}
+
+protected:
+  kj::Promise<void> optimize(OptimizeContext context) override {
+    auto params = context.getParams();
+    frames_t frames = params.getFrames();
+    uint64_t key = settingsFingerprint(params.getSettings());
+
+    // A run to a longer horizon answers this too
+    Result* memo = results_.find(key);
+    if (!memo || memo->horizon_ < frames) {
+      Simulator sim;
+      AdventurerState init;
+      setUp(params.getSettings(), &sim, &init);
+      auto automaton = getAutomaton(sim, init);
+      Result result;
+      result.horizon_ = frames;
+      optimizeRotation(sim, *automaton, frames, perf_, [&](const Improvement& imp) {
+        result.improvements_.emplace_back(imp);
+      });
+      memo = &results_.insert(key, std::move(result));
+    } else {
+      KJ_LOG(INFO, key, frames, "memoized result");
+    }
+
+    const auto& improvements = memo->improvements_;
+    size_t n = 0;
+    while (n < improvements.size() && improvements[n].frames_ < frames) n++;
+    auto list = context.getResults().initImprovements(n);
+    for (size_t i = 0; i < n; i++) {
+      list[i].setRotation(improvements[i].rotation_.c_str());
+      list[i].setDmg(improvements[i].dmg_);
+      list[i].setFrames(improvements[i].frames_);
+    }
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> evaluate(EvaluateContext context) override {
+    auto params = context.getParams();
+    auto mb_rotation = parseRotation(params.getRotation());
+    KJ_REQUIRE(!!mb_rotation, params.getRotation(), "could not parse rotation");
+
+    Simulator sim;
+    AdventurerState init;
+    setUp(params.getSettings(), &sim, &init);
+    auto r = simulateRotations(sim, init, {std::move(*mb_rotation)})[0];
+
+    auto result = context.getResults().initResult();
+    result.setValid(r.valid_);
+    result.setFailedAt(r.failedAt_);
+    result.setDmg(r.dmg_);
+    result.setFrames(r.frames_);
+    return kj::READY_NOW;
+  }
+
+private:
+  struct Result {
+    frames_t horizon_ = 0;
+    std::vector<Improvement> improvements_;
+  };
+
+  // Set up as the command line tools would be with these settings
+  static void setUp(Settings::Reader settings, Simulator* sim, AdventurerState* init) {
+    if (settings.getNumSkills()) {
+      sim->setNumSkills(settings.getNumSkills());
+    }
+    sim->setProjectileDelay(settings.getProjectileDelay());
+    sim->setConfig(capnp::clone(settings.getConfig()));
+    std::optional<uint8_t> skill_prep;
+    if (settings.getSkillPrep() >= 0) {
+      skill_prep = settings.getSkillPrep();
+    }
+    *init = sim->applyPrep(*init, skill_prep);
+  }
+
+  // Everything a result depends on (but the horizon)
+  static uint64_t settingsFingerprint(Settings::Reader settings) {
+    Fingerprint fp;
+    auto config = capnp::canonicalize(settings.getConfig());
+    fp.add(config.begin(), config.size() * sizeof(capnp::word));
+    fp.add(settings.getNumSkills());
+    fp.add(settings.getProjectileDelay());
+    fp.add(settings.getSkillPrep());
+    return fp.h_;
+  }
+
+  std::shared_ptr<Automaton> getAutomaton(Simulator& sim, AdventurerState init) {
+    uint64_t fingerprint = automatonFingerprint(sim, init);
+    if (auto* automaton = automata_.find(fingerprint)) {
+      KJ_LOG(INFO, fingerprint, "automaton in memory");
+      return *automaton;
+    }
+    auto automaton = std::make_shared<Automaton>(
+        loadOrBuildAutomaton(sim, init, cacheDir_, perf_));
+    automata_.insert(fingerprint, automaton);
+    return automaton;
+  }
+
+  std::optional<kj::StringPtr> cacheDir_;
+  LruCache<std::shared_ptr<Automaton>> automata_;
+  // Small next to the automata, but without a bound a long running
+  // server would still grow forever
+  LruCache<Result> results_;
+  PerfReport perf_;
+};
+
+class DLGrindServer : DLGrind {
+public:
+  explicit DLGrindServer(kj::ProcessContext& context)
+      : DLGrind(context) {}
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context_, "dlgrind-server",
+        "Answer optimize and evaluate requests (see server.capnp) over capnp RPC "
+        "on a unix socket, keeping automata and results across requests")
+      .addOptionWithArg({"cache-dir"}, KJ_BIND_METHOD(*this, setCacheDir),
+          "<dir>", "Also cache automata on disk in <dir> (as dlgrind-opt --cache-dir).")
+      .addOptionWithArg({"max-automata"}, KJ_BIND_METHOD(*this, setMaxAutomata),
+          "<number>", "Number of automata (and of memoized results) to keep in memory "
+          "(default 8).")
+      .expectArg("<socket>", KJ_BIND_METHOD(*this, setSocket))
+      .callAfterParsing(KJ_BIND_METHOD(*this, run))
+      .build();
+  }
+
+  kj::MainBuilder::Validity setCacheDir(kj::StringPtr dir) {
+    cacheDir_ = dir;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setMaxAutomata(kj::StringPtr n) {
+    maxAutomata_ = n.parseAs<size_t>();
+    return true;
+  }
+
+  kj::MainBuilder::Validity setSocket(kj::StringPtr socket) {
+    socket_ = socket;
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    // NB: requests are handled one at a time on the event loop; each
+    // one parallelizes internally
+    auto address = kj::str("unix:", socket_);
+    capnp::EzRpcServer server(kj::heap<OptimizerImpl>(cacheDir_, maxAutomata_), address);
+    KJ_LOG(INFO, socket_, "listening");
+    kj::NEVER_DONE.wait(server.getWaitScope());
+  }
+
+private:
+  std::optional<kj::StringPtr> cacheDir_;
+  size_t maxAutomata_ = 8;
+  kj::StringPtr socket_;
+};
+
+KJ_MAIN(DLGrindServer);
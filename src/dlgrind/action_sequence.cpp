@@ -0,0 +1,138 @@
+#include <dlgrind/action_sequence.h>
+
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <limits>
+
+ActionSequenceStore::ActionSequenceStore() {
+  nodes_.push_back({EMPTY, ActionFragment::NIL, 0});
+  rehash(1 << 10);
+}
+
+size_t ActionSequenceStore::hash(seq_id_t parent, ActionFragment fragment) {
+  uint64_t x = (static_cast<uint64_t>(parent) << 4) | static_cast<uint8_t>(fragment);
+  x *= 0x9e3779b97f4a7c15ULL;
+  return x ^ (x >> 32);
+}
+
+void ActionSequenceStore::rehash(size_t capacity) {
+  table_.assign(capacity, EMPTY);
+  size_t mask = capacity - 1;
+  for (seq_id_t id = 1; id < nodes_.size(); id++) {
+    size_t i = hash(nodes_[id].parent_, nodes_[id].fragment_) & mask;
+    while (table_[i] != EMPTY) i = (i + 1) & mask;
+    table_[i] = id;
+  }
+}
+
+seq_id_t ActionSequenceStore::intern(seq_id_t parent, ActionFragment fragment) {
+  size_t mask = table_.size() - 1;
+  size_t i = hash(parent, fragment) & mask;
+  for (; table_[i] != EMPTY; i = (i + 1) & mask) {
+    const auto& n = nodes_[table_[i]];
+    if (n.parent_ == parent && n.fragment_ == fragment) return table_[i];
+  }
+  KJ_REQUIRE(nodes_.size() < std::numeric_limits<seq_id_t>::max(), "sequence store full");
+  seq_id_t id = nodes_.size();
+  nodes_.push_back({parent, fragment, nodes_[parent].depth_ + 1});
+  table_[i] = id;
+  // Keep the load factor under a half
+  if (nodes_.size() * 2 > table_.size()) rehash(table_.size() * 2);
+  return id;
+}
+
+seq_id_t ActionSequenceStore::push(seq_id_t id, Action ac) {
+  if (id != EMPTY) {
+    auto mb_c = ActionString::coalesce(nodes_[id].fragment_, ac);
+    if (mb_c) return intern(nodes_[id].parent_, *mb_c);
+  }
+  return intern(id, ActionString::fragment(ac));
+}
+
+std::vector<ActionFragment> ActionSequenceStore::fragments(seq_id_t id) const {
+  std::vector<ActionFragment> r;
+  for (; id != EMPTY; id = nodes_[id].parent_) {
+    r.push_back(nodes_[id].fragment_);
+  }
+  std::reverse(r.begin(), r.end());
+  return r;
+}
+
+ActionSequenceStore::Pending ActionSequenceStore::pending(seq_id_t id) const {
+  // The empty sequence as [NIL]: NIL (0) sorts before every fragment,
+  // as the end of a proper prefix does
+  if (id == EMPTY) return {EMPTY, ActionFragment::NIL};
+  return {nodes_[id].parent_, nodes_[id].fragment_};
+}
+
+ActionSequenceStore::Pending ActionSequenceStore::pending(seq_id_t id, Action ac) const {
+  if (id != EMPTY) {
+    auto mb_c = ActionString::coalesce(nodes_[id].fragment_, ac);
+    if (mb_c) return {nodes_[id].parent_, *mb_c};
+  }
+  return {id, ActionString::fragment(ac)};
+}
+
+bool ActionSequenceStore::less(Pending a, Pending b) const {
+  // Find the first position where they may differ: just past the
+  // common ancestor of the prefixes.  xa and xb are the fragments
+  // there; a_last (b_last) if that is last_, which is the end of the
+  // sequence.
+  seq_id_t ia = a.prefix_, ib = b.prefix_;
+  ActionFragment xa = a.last_, xb = b.last_;
+  bool a_last = true, b_last = true;
+  while (nodes_[ia].depth_ > nodes_[ib].depth_) {
+    xa = nodes_[ia].fragment_;
+    a_last = false;
+    ia = nodes_[ia].parent_;
+  }
+  while (nodes_[ib].depth_ > nodes_[ia].depth_) {
+    xb = nodes_[ib].fragment_;
+    b_last = false;
+    ib = nodes_[ib].parent_;
+  }
+  while (ia != ib) {
+    xa = nodes_[ia].fragment_;
+    xb = nodes_[ib].fragment_;
+    a_last = b_last = false;
+    ia = nodes_[ia].parent_;
+    ib = nodes_[ib].parent_;
+  }
+  if (xa != xb) return xa < xb;
+  // Siblings in the tree never share a fragment, so one of these is
+  // a last_; if only a's, a is a proper prefix of b
+  return a_last && !b_last;
+}
+
+void ActionSequenceStore::print(std::ostream& os, seq_id_t id) const {
+  for (auto f : fragments(id)) {
+    os << fragmentString(f);
+  }
+}
+
+void ActionSequenceStore::compact(kj::ArrayPtr<seq_id_t> ids) {
+  // Mark everything reachable
+  std::vector<uint8_t> live(nodes_.size(), 0);
+  live[EMPTY] = 1;
+  for (auto id : ids) {
+    for (; !live[id]; id = nodes_[id].parent_) live[id] = 1;
+  }
+  // Parents always come before their children, so renumbering in
+  // order keeps that invariant, and parents are remapped first
+  std::vector<seq_id_t> remap(nodes_.size(), EMPTY);
+  size_t n = 1;
+  for (seq_id_t id = 1; id < nodes_.size(); id++) {
+    if (!live[id]) continue;
+    remap[id] = n;
+    nodes_[n] = {remap[nodes_[id].parent_], nodes_[id].fragment_, nodes_[id].depth_};
+    n++;
+  }
+  KJ_LOG(INFO, nodes_.size(), n, "compacted sequence store");
+  nodes_.resize(n);
+  nodes_.shrink_to_fit();
+  for (auto& id : ids) id = remap[id];
+  size_t capacity = 1 << 10;
+  while (capacity < n * 2) capacity *= 2;
+  rehash(capacity);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <dlgrind/action_string.h>
+
+#include <kj/common.h>
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+using seq_id_t = uint32_t;
+
+// Unbounded alternative to ActionString, for long horizons.
+//
+// A sequence is a node in a tree: the node holds its last fragment
+// and the id of the sequence before it.  Nodes live in one arena and
+// are hash-consed, so a DP cell only holds a 4-byte id, and the
+// prefix shared by many cells (which is most of it) is stored once.
+//
+// Nodes are never freed individually; call compact() every so often
+// with all the ids still in use to drop the rest.
+//
+// Reads (get, fragments, pending, less, print) may run concurrently with
+// each other, but not with push or compact.
+class ActionSequenceStore {
+public:
+  static constexpr seq_id_t EMPTY = 0;
+
+  ActionSequenceStore();
+
+  // id followed by ac.  As with ActionString::push, ac is coalesced
+  // into the last fragment of id when possible.
+  seq_id_t push(seq_id_t id, Action ac);
+
+  // id followed by a whole fragment.  Never coalesced: callers only
+  // append fragments that cannot continue the one before (see
+  // Automaton::macroActions_).
+  seq_id_t push(seq_id_t id, ActionFragment f) { return intern(id, f); }
+
+  // Fragments of id, in order
+  std::vector<ActionFragment> fragments(seq_id_t id) const;
+
+  // A sequence that need not be interned: the stored prefix_, then
+  // last_.  Candidates are compared in this form, so a tie break does
+  // not allocate.
+  struct Pending {
+    seq_id_t prefix_;
+    ActionFragment last_;
+  };
+  // id itself
+  Pending pending(seq_id_t id) const;
+  // push(id, ac), without interning it
+  Pending pending(seq_id_t id, Action ac) const;
+  Pending pending(seq_id_t id, ActionFragment f) const { return {id, f}; }
+
+  // Same order as comparing the equivalent ActionStrings.  Walks both
+  // prefixes only as far back as their common ancestor.
+  bool less(Pending a, Pending b) const;
+
+  void print(std::ostream& os, seq_id_t id) const;
+
+  // Drop every node not reachable from ids, renumbering ids in place
+  void compact(kj::ArrayPtr<seq_id_t> ids);
+
+  size_t size() const { return nodes_.size(); }
+
+private:
+  struct Node {
+    seq_id_t parent_;
+    ActionFragment fragment_;
+    uint32_t depth_;  // number of fragments
+  };
+
+  seq_id_t intern(seq_id_t parent, ActionFragment fragment);
+  void rehash(size_t capacity);
+  static size_t hash(seq_id_t parent, ActionFragment fragment);
+
+  std::vector<Node> nodes_;
+  // Open addressing (linear probing) over node ids; EMPTY marks a
+  // free slot, since the empty sequence is never interned
+  std::vector<seq_id_t> table_;
+};
@@ -1,5 +1,8 @@
+#pragma once
+
 #include <cstdint>
 #include <array>
+#include <optional>
 #include <ostream>
 
 #include <kj/debug.h>
@@ -53,6 +56,40 @@ enum class ActionFragment : uint8_t { // actually only four bit
   // 15 (one free slot)
 };
 
+// Number of fragment codes, NIL included
+constexpr size_t NUM_ACTION_FRAGMENTS = 15;
+
+// Combo fragments (C1 ... C5FS) by length and whether they end in a
+// force strike; this relies on the interleaving above
+inline bool isCombo(ActionFragment f) {
+  return f >= ActionFragment::C1 && f <= ActionFragment::C5FS;
+}
+inline int comboLength(ActionFragment f) {
+  return (static_cast<uint8_t>(f) - static_cast<uint8_t>(ActionFragment::C1)) / 2 + 1;
+}
+inline bool comboFs(ActionFragment f) {
+  return (static_cast<uint8_t>(f) - static_cast<uint8_t>(ActionFragment::C1)) % 2 == 1;
+}
+inline ActionFragment combo(int length, bool fs) {
+  return static_cast<ActionFragment>(
+      static_cast<uint8_t>(ActionFragment::C1) + 2 * (length - 1) + fs);
+}
+
+// Call f on each action of fragment, in order
+template <typename F>
+void forEachAction(ActionFragment fragment, F&& f) {
+  switch (fragment) {
+    case ActionFragment::NIL: return;
+    case ActionFragment::FS: f(Action::FS); return;
+    case ActionFragment::S1: f(Action::S1); return;
+    case ActionFragment::S2: f(Action::S2); return;
+    case ActionFragment::S3: f(Action::S3); return;
+    default: break;
+  }
+  for (int i = 0; i < comboLength(fragment); i++) f(Action::X);
+  if (comboFs(fragment)) f(Action::FS);
+}
+
 // Fixed size encoding of action strings.  Supports "compressed" action
 // string of size up to 32, in 16 bytes of space.  NIL terminated.
 struct ActionString {
@@ -110,6 +147,54 @@ struct ActionString {
     }
     buffer_[i / 2] = _pack(first, second);
   }
+  // The fragment that results from doing ac right after fragment
+  // prev, if the two coalesce (e.g., c2 then x is c3).
+  static std::optional<ActionFragment> coalesce(ActionFragment prev, Action ac) {
+    switch (ac) {
+      case Action::X:
+        switch (prev) {
+          case ActionFragment::C1:
+          case ActionFragment::C2:
+          case ActionFragment::C3:
+          case ActionFragment::C4:
+            return i2f(f2i(prev) + 2);
+          default:
+            break;
+        }
+        break;
+      case Action::FS:
+        switch (prev) {
+          case ActionFragment::C1:
+          case ActionFragment::C2:
+          case ActionFragment::C3:
+          case ActionFragment::C4:
+          case ActionFragment::C5:
+            return i2f(f2i(prev) + 1);
+          default:
+            break;
+        }
+        break;
+      default:
+        break;
+    }
+    return std::nullopt;
+  }
+  // The fragment for ac on its own
+  static ActionFragment fragment(Action ac) {
+    switch (ac) {
+      case Action::X:
+        return ActionFragment::C1;
+      case Action::FS:
+        return ActionFragment::FS;
+      case Action::S1:
+        return ActionFragment::S1;
+      case Action::S2:
+        return ActionFragment::S2;
+      case Action::S3:
+        return ActionFragment::S3;
+    }
+    KJ_UNREACHABLE;
+  }
   // Push an action code to an action string.  The code will
   // be coalesced with the latest action fragment if possible.
   void push(Action ac) {
@@ -125,110 +210,43 @@ struct ActionString {
     // Check if we can absorb this into the
     // previous entry
     if (loc != 0) {
-      ActionFragment p_c = get(loc - 1);
-      switch (ac) {
-        case Action::X:
-          switch (p_c) {
-            case ActionFragment::C1:
-            case ActionFragment::C2:
-            case ActionFragment::C3:
-            case ActionFragment::C4:
-              set(loc - 1, i2f(f2i(p_c) + 2));
-              return;
-            default:
-              break;
-          }
-          break;
-        case Action::FS:
-          switch (p_c) {
-            case ActionFragment::C1:
-            case ActionFragment::C2:
-            case ActionFragment::C3:
-            case ActionFragment::C4:
-            case ActionFragment::C5:
-              set(loc - 1, i2f(f2i(p_c) + 1));
-              return;
-            default:
-              break;
-          }
-          break;
-        default:
-          break;
+      auto mb_c = coalesce(get(loc - 1), ac);
+      if (mb_c) {
+        set(loc - 1, *mb_c);
+        return;
       }
     }
-    ActionFragment c;
-    switch (ac) {
-      case Action::X:
-        c = ActionFragment::C1;
-        break;
-      case Action::FS:
-        c = ActionFragment::FS;
-        break;
-      case Action::S1:
-        c = ActionFragment::S1;
-        break;
-      case Action::S2:
-        c = ActionFragment::S2;
-        break;
-      case Action::S3:
-        c = ActionFragment::S3;
-        break;
-      default:
-        KJ_ASSERT(0, ac);
-    }
-    set(loc, c);
+    set(loc, fragment(ac));
   }
 };
 
-std::ostream& operator<<(std::ostream& os, const ActionString& as) {
+// As printed in rotations (skills are padded, to stand out)
+inline const char* fragmentString(ActionFragment f) {
+  switch (f) {
+    case ActionFragment::NIL: return "";
+    case ActionFragment::C1: return "c1 ";
+    case ActionFragment::C2: return "c2 ";
+    case ActionFragment::C3: return "c3 ";
+    case ActionFragment::C4: return "c4 ";
+    case ActionFragment::C5: return "c5 ";
+    case ActionFragment::C1FS: return "c1fs ";
+    case ActionFragment::C2FS: return "c2fs ";
+    case ActionFragment::C3FS: return "c3fs ";
+    case ActionFragment::C4FS: return "c4fs ";
+    case ActionFragment::C5FS: return "c5fs ";
+    case ActionFragment::FS: return "fs ";
+    case ActionFragment::S1: return "s1  ";
+    case ActionFragment::S2: return "s2  ";
+    case ActionFragment::S3: return "s3  ";
+  }
+  return "";
+}
+
+inline std::ostream& operator<<(std::ostream& os, const ActionString& as) {
   for (int i = 0; i < 32; i++) {
     ActionFragment f = as.get(i);
-    switch(f) {
-      case ActionFragment::NIL:
-        return os;
-      case ActionFragment::C1:
-        os << "c1 ";
-        break;
-      case ActionFragment::C2:
-        os << "c2 ";
-        break;
-      case ActionFragment::C3:
-        os << "c3 ";
-        break;
-      case ActionFragment::C4:
-        os << "c4 ";
-        break;
-      case ActionFragment::C5:
-        os << "c5 ";
-        break;
-      case ActionFragment::C1FS:
-        os << "c1fs ";
-        break;
-      case ActionFragment::C2FS:
-        os << "c2fs ";
-        break;
-      case ActionFragment::C3FS:
-        os << "c3fs ";
-        break;
-      case ActionFragment::C4FS:
-        os << "c4fs ";
-        break;
-      case ActionFragment::C5FS:
-        os << "c5fs ";
-        break;
-      case ActionFragment::FS:
-        os << "fs ";
-        break;
-      case ActionFragment::S1:
-        os << "s1  ";
-        break;
-      case ActionFragment::S2:
-        os << "s2  ";
-        break;
-      case ActionFragment::S3:
-        os << "s3  ";
-        break;
-    }
+    if (f == ActionFragment::NIL) return os;
+    os << fragmentString(f);
   }
   return os;
 }
@@ -0,0 +1,854 @@
+#include <dlgrind/automaton.h>
+#include <dlgrind/fingerprint.h>
+#include <dlgrind/mmap.h>
+#include <dlgrind/trace.h>
+
+#include <kj/debug.h>
+#include <kj/exception.h>
+
+#include <magic_enum.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+namespace std {
+  template<typename T>
+  inline void hash_combine(std::size_t& seed, const T& val) {
+    std::hash<T> hasher;
+    seed ^= hasher(val) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+  }
+
+  // taken from https://stackoverflow.com/a/7222201/916549
+  template<typename S, typename T>
+  struct hash<std::pair<S, T>> {
+    inline size_t operator()(const std::pair<S, T>& val) const {
+      size_t seed = 0;
+      hash_combine(seed, val.first);
+      hash_combine(seed, val.second);
+      return seed;
+    }
+  };
+}
+
+namespace {
+
+using state_code_t = uint64_t;
+
+// Keyed on packed states (see StateLayout), which are much smaller
+// and cheaper to hash than AdventurerState
+using InverseMap = PackedStateMap<std::vector<std::pair<PackedState, action_code_t>>>;
+
+struct StateCode {
+  PackedStateMap<state_code_t> encode_;
+  std::vector<PackedState> decode_;
+};
+
+// The action codes of an automaton (see Automaton::macroActions_)
+std::vector<action_code_t> actionCodes(bool macro_actions) {
+  std::vector<action_code_t> r;
+  if (macro_actions) {
+    for (size_t c = 0; c < NUM_ACTION_FRAGMENTS; c++) {
+      if (static_cast<ActionFragment>(c) != ActionFragment::NIL) r.push_back(c);
+    }
+  } else {
+    for (auto a : magic_enum::enum_values<Action>()) r.push_back(toIndex(a));
+  }
+  return r;
+}
+
+// applyActionCode on a batch, as Simulator::applyActionBatch
+void applyActionCodeBatch(
+    Simulator& sim, bool macro_actions, const AdventurerStateBatch& prev, action_code_t code,
+    AdventurerStateBatch* after_out, std::vector<frames_t>* frames_out,
+    std::vector<double>* dmg_out, std::vector<uint8_t>* valid_out) {
+  if (!macro_actions) {
+    sim.applyActionBatch(prev, static_cast<Action>(code), after_out, frames_out, dmg_out, valid_out);
+    return;
+  }
+  auto f = static_cast<ActionFragment>(code);
+  sim.applyFragmentBatch(prev, f, after_out, frames_out, dmg_out, valid_out);
+  for (size_t i = 0; i < prev.size(); i++) {
+    if (!macroActionAllowed(prev.afterAction_[i], f)) (*valid_out)[i] = 0;
+  }
+}
+
+// returns inverse_map, inverse_size (number of transitions)
+std::pair<InverseMap, size_t> computeReachableStates(
+    Simulator& sim, AdventurerState init, bool macro_actions, PerfReport& perf_report) {
+  auto perf = perf_report.phase("reachability");
+  TraceSpan trace("reachability");
+  // Compute reachable states
+  const auto& layout = sim.layout();
+  KJ_LOG(INFO, layout.bits(), "packed state bits");
+  InverseMap inverse_map;
+  size_t inverse_size = 0;
+  {
+    // Explore breadth first, so that we can hand the simulator a
+    // whole frontier of states at once
+    std::vector<AdventurerState> frontier{init};
+    inverse_map[layout.pack(init)];
+    AdventurerStateBatch batch;
+    AdventurerStateBatch n_batch;
+    std::vector<frames_t> frames;
+    std::vector<double> dmg;
+    std::vector<uint8_t> valid;
+    std::vector<PackedState> packed_frontier;
+    while (frontier.size()) {
+      batch.resize(frontier.size());
+      packed_frontier.resize(frontier.size());
+      for (size_t i = 0; i < frontier.size(); i++) {
+        batch.set(i, frontier[i]);
+        packed_frontier[i] = layout.pack(frontier[i]);
+      }
+      std::vector<AdventurerState> n_frontier;
+      for (auto a : actionCodes(macro_actions)) {
+        applyActionCodeBatch(sim, macro_actions, batch, a, &n_batch, &frames, &dmg, &valid);
+        for (size_t i = 0; i < frontier.size(); i++) {
+          if (!valid[i]) continue;
+          auto n_s = n_batch.get(i);
+          auto n_packed = layout.pack(n_s);
+          auto [it, inserted] = inverse_map.try_emplace(n_packed);
+          if (inserted) {
+            n_frontier.emplace_back(n_s);
+          }
+          it->second.emplace_back(packed_frontier[i], a);
+          inverse_size++;
+        }
+      }
+      frontier = std::move(n_frontier);
+    }
+  }
+  KJ_LOG(INFO, inverse_map.size(), "initial states");
+  return {std::move(inverse_map), inverse_size};
+}
+
+// computeReachableStates, but only the states some rotation of fewer
+// than horizon frames reaches, and only the transitions such a
+// rotation can take.  Explores in order of earliest arrival (Dijkstra,
+// with a bucket per frame since every transition takes a whole number
+// of frames), handing the simulator a bucket at a time.  A transition
+// out of a state whose earliest arrival plus its length is past the
+// horizon is never part of such a rotation, so it is dropped even if
+// its target is reachable some other way.
+std::pair<InverseMap, size_t> computeReachableStatesWithin(
+    Simulator& sim, AdventurerState init, frames_t horizon, bool macro_actions,
+    PerfReport& perf_report) {
+  auto perf = perf_report.phase("reachability");
+  TraceSpan trace("reachability");
+  const auto& layout = sim.layout();
+  KJ_LOG(INFO, layout.bits(), horizon, "packed state bits");
+  InverseMap inverse_map;
+  size_t inverse_size = 0;
+  {
+    PackedStateMap<frames_t> arrival;
+    // buckets[f]: states first reached at frame f (or a stale copy of a
+    // state since reached earlier)
+    std::vector<std::vector<AdventurerState>> buckets(horizon);
+    buckets[0].push_back(init);
+    arrival[layout.pack(init)] = 0;
+    inverse_map[layout.pack(init)];
+    AdventurerStateBatch batch;
+    AdventurerStateBatch n_batch;
+    std::vector<frames_t> frames;
+    std::vector<double> dmg;
+    std::vector<uint8_t> valid;
+    std::vector<PackedState> packed_frontier;
+    for (frames_t f = 0; f < horizon; f++) {
+      // Loop, since a transition could take no time
+      while (!buckets[f].empty()) {
+        std::vector<AdventurerState> frontier;
+        frontier.swap(buckets[f]);
+        packed_frontier.clear();
+        size_t n = 0;
+        for (const auto& st : frontier) {
+          auto packed = layout.pack(st);
+          if (arrival[packed] != f) continue;
+          frontier[n++] = st;
+          packed_frontier.push_back(packed);
+        }
+        frontier.resize(n);
+        batch.resize(n);
+        for (size_t i = 0; i < n; i++) batch.set(i, frontier[i]);
+        for (auto a : actionCodes(macro_actions)) {
+          applyActionCodeBatch(sim, macro_actions, batch, a, &n_batch, &frames, &dmg, &valid);
+          for (size_t i = 0; i < n; i++) {
+            if (!valid[i] || f + frames[i] >= horizon) continue;
+            frames_t t = f + frames[i];
+            auto n_s = n_batch.get(i);
+            auto n_packed = layout.pack(n_s);
+            auto [it, inserted] = arrival.try_emplace(n_packed, t);
+            if (inserted || t < it->second) {
+              it->second = t;
+              buckets[t].emplace_back(n_s);
+            }
+            inverse_map[n_packed].emplace_back(packed_frontier[i], a);
+            inverse_size++;
+          }
+        }
+      }
+      // Settled; free as we go
+      std::vector<AdventurerState>().swap(buckets[f]);
+    }
+  }
+  KJ_LOG(INFO, inverse_map.size(), horizon, "initial states within horizon");
+  return {std::move(inverse_map), inverse_size};
+}
+
+// The key of a state's block in the initial partition of the
+// minimization
+AdventurerState coarsenState(AdventurerState s) {
+  for (size_t i = 0; i < 3; i++) {
+    s.sp_[i] = 0;
+    s.energy_ = s.energy_ == 5;
+    s.buffFramesLeft_[i] = s.buffFramesLeft_[i] != 0;
+  }
+  return s;
+}
+
+StateCode numberStates(const InverseMap& inverse_map, PerfReport& perf_report) {
+  auto perf = perf_report.phase("numbering");
+  TraceSpan trace("numbering");
+
+  StateCode state_code;
+  for (const auto& kv : inverse_map) {
+    state_code.encode_.emplace(kv.first, state_code.decode_.size());
+    state_code.decode_.emplace_back(kv.first);
+  }
+  return state_code;
+}
+
+// On the fly minimization (see AutomatonOptions::onTheFly_)
+
+constexpr uint32_t NO_STATE = 0xFFFFFFFF;
+constexpr partition_t NO_PARTITION = 0xFFFFFFFF;
+
+// The reachable states without the transitions between them, sorted,
+// so a state's code is its index and is found by binary search; with
+// a horizon, also the frame each is first reached at
+struct ReachableStates {
+  std::vector<PackedState> states_;
+  std::vector<frames_t> arrival_;
+
+  uint32_t find(const PackedState& st) const {
+    auto it = std::lower_bound(states_.begin(), states_.end(), st, packedLess);
+    if (it == states_.end() || *it != st) return NO_STATE;
+    return it - states_.begin();
+  }
+
+  static bool packedLess(const PackedState& a, const PackedState& b) {
+    return a.words_ < b.words_;
+  }
+};
+
+// computeReachableStates (or ...Within, with a horizon), remembering
+// only which states were reached
+ReachableStates computeReachableStateSet(
+    Simulator& sim, AdventurerState init, const AutomatonOptions& options,
+    PerfReport& perf_report) {
+  auto perf = perf_report.phase("reachability");
+  TraceSpan trace("reachability");
+  const auto& layout = sim.layout();
+  const frames_t horizon = options.horizon_.value_or(0);
+  KJ_LOG(INFO, layout.bits(), horizon, "packed state bits");
+  // Without a horizon, every arrival is 0 and there is one bucket,
+  // which is breadth first
+  PackedStateMap<frames_t> arrival;
+  std::vector<std::vector<AdventurerState>> buckets(options.horizon_ ? horizon : 1);
+  buckets[0].push_back(init);
+  arrival[layout.pack(init)] = 0;
+  AdventurerStateBatch batch;
+  AdventurerStateBatch n_batch;
+  std::vector<frames_t> frames;
+  std::vector<double> dmg;
+  std::vector<uint8_t> valid;
+  for (frames_t f = 0; f < buckets.size(); f++) {
+    while (!buckets[f].empty()) {
+      std::vector<AdventurerState> frontier;
+      frontier.swap(buckets[f]);
+      size_t n = 0;
+      for (const auto& st : frontier) {
+        if (arrival[layout.pack(st)] == f) frontier[n++] = st;
+      }
+      frontier.resize(n);
+      batch.resize(n);
+      for (size_t i = 0; i < n; i++) batch.set(i, frontier[i]);
+      for (auto a : actionCodes(options.macroActions_)) {
+        applyActionCodeBatch(sim, options.macroActions_, batch, a, &n_batch, &frames, &dmg, &valid);
+        for (size_t i = 0; i < n; i++) {
+          if (!valid[i]) continue;
+          frames_t t = 0;
+          if (options.horizon_) {
+            if (f + frames[i] >= horizon) continue;
+            t = f + frames[i];
+          }
+          auto n_s = n_batch.get(i);
+          auto [it, inserted] = arrival.try_emplace(layout.pack(n_s), t);
+          if (inserted || t < it->second) {
+            it->second = t;
+            buckets[t].emplace_back(n_s);
+          }
+        }
+      }
+    }
+    std::vector<AdventurerState>().swap(buckets[f]);
+  }
+
+  ReachableStates r;
+  r.states_.reserve(arrival.size());
+  for (const auto& kv : arrival) r.states_.push_back(kv.first);
+  std::sort(r.states_.begin(), r.states_.end(), ReachableStates::packedLess);
+  KJ_REQUIRE(r.states_.size() < NO_STATE, r.states_.size(), "too many states");
+  if (options.horizon_) {
+    r.arrival_.resize(r.states_.size());
+    for (size_t i = 0; i < r.states_.size(); i++) r.arrival_[i] = arrival[r.states_[i]];
+  }
+  KJ_LOG(INFO, r.states_.size(), horizon, "initial states");
+  return r;
+}
+
+// The code of the state each action code leads to from each of the
+// given states (NO_STATE if it is illegal, or with a horizon, would
+// not be taken; see computeReachableStatesWithin), as out[i *
+// codes.size() + j]
+void successorStates(
+    Simulator& sim, const ReachableStates& reachable, const AutomatonOptions& options,
+    const std::vector<action_code_t>& codes, const uint32_t* states, size_t n,
+    std::vector<uint32_t>* out) {
+  const auto& layout = sim.layout();
+  AdventurerStateBatch batch;
+  AdventurerStateBatch n_batch;
+  std::vector<frames_t> frames;
+  std::vector<double> dmg;
+  std::vector<uint8_t> valid;
+  batch.resize(n);
+  for (size_t i = 0; i < n; i++) batch.set(i, layout.unpack(reachable.states_[states[i]]));
+  out->assign(n * codes.size(), NO_STATE);
+  for (size_t j = 0; j < codes.size(); j++) {
+    applyActionCodeBatch(sim, options.macroActions_, batch, codes[j], &n_batch, &frames, &dmg, &valid);
+    for (size_t i = 0; i < n; i++) {
+      if (!valid[i]) continue;
+      if (options.horizon_ && reachable.arrival_[states[i]] + frames[i] >= *options.horizon_) continue;
+      uint32_t t = reachable.find(layout.pack(n_batch.get(i)));
+      KJ_ASSERT(t != NO_STATE, "successor of a reachable state is not reachable");
+      (*out)[i * codes.size() + j] = t;
+    }
+  }
+}
+
+// A state's block, then the block each action code leads to
+using Signature = std::array<partition_t, NUM_ACTION_FRAGMENTS + 1>;
+
+struct SignatureHasher {
+  size_t operator()(const Signature& sig) const {
+    size_t seed = 0;
+    for (auto b : sig) std::hash_combine(seed, b);
+    return seed;
+  }
+};
+
+// Moore's algorithm, from the same initial partition as Hopcroft's:
+// split blocks by the blocks their states' actions lead to until no
+// block splits.  This finds the same partition, but the transitions
+// are simulated again every round rather than stored, so besides the
+// states themselves it takes two block numbers per state and one
+// signature per block.  Returns the block of each state.
+std::vector<partition_t> mooreRefine(
+    Simulator& sim, const ReachableStates& reachable, const AutomatonOptions& options,
+    uint32_t* num_blocks_out, PerfReport& perf_report) {
+  const size_t num_states = reachable.states_.size();
+  const auto codes = actionCodes(options.macroActions_);
+
+  std::vector<partition_t> block(num_states);
+  uint32_t num_blocks;
+  {
+    auto perf = perf_report.phase("initial-partition");
+    TraceSpan trace("initial-partition");
+    AdventurerStateMap<partition_t> partition_map;
+    for (size_t i = 0; i < num_states; i++) {
+      auto s = coarsenState(sim.layout().unpack(reachable.states_[i]));
+      block[i] = partition_map.emplace(s, partition_map.size()).first->second;
+    }
+    num_blocks = partition_map.size();
+    KJ_LOG(INFO, num_blocks, "initial number of partitions");
+  }
+
+  auto perf = perf_report.phase("moore");
+  // Signatures are computed in parallel a window at a time, then
+  // numbered in order
+  constexpr size_t CHUNK = 4096;
+  constexpr size_t WINDOW = 64 * CHUNK;
+  std::vector<Signature> sigs(std::min(WINDOW, num_states));
+  std::vector<partition_t> n_block(num_states);
+  for (size_t round = 0; ; round++) {
+    TraceSpan trace("moore-round", round);
+    std::unordered_map<Signature, partition_t, SignatureHasher> blocks;
+    for (size_t begin = 0; begin < num_states; begin += WINDOW) {
+      size_t end = std::min(begin + WINDOW, num_states);
+      #pragma omp parallel
+      {
+        std::vector<uint32_t> states;
+        std::vector<uint32_t> succ;
+        #pragma omp for schedule(dynamic)
+        for (size_t c = begin; c < end; c += CHUNK) {
+          size_t n = std::min(c + CHUNK, end) - c;
+          states.resize(n);
+          for (size_t i = 0; i < n; i++) states[i] = c + i;
+          successorStates(sim, reachable, options, codes, states.data(), n, &succ);
+          for (size_t i = 0; i < n; i++) {
+            auto& sig = sigs[c - begin + i];
+            sig.fill(NO_PARTITION);
+            sig[0] = block[c + i];
+            for (size_t j = 0; j < codes.size(); j++) {
+              uint32_t t = succ[i * codes.size() + j];
+              if (t != NO_STATE) sig[j + 1] = block[t];
+            }
+          }
+        }
+      }
+      for (size_t i = begin; i < end; i++) {
+        n_block[i] = blocks.emplace(sigs[i - begin], blocks.size()).first->second;
+      }
+    }
+    // Blocks only ever split, so the same number means nothing did
+    bool stable = blocks.size() == num_blocks;
+    num_blocks = blocks.size();
+    block.swap(n_block);
+    KJ_LOG(INFO, round, num_blocks, "moore round");
+    if (stable) break;
+  }
+  *num_blocks_out = num_blocks;
+  return block;
+}
+
+Automaton buildAutomatonOnTheFly(
+    Simulator& sim, AdventurerState init, PerfReport& perf_report,
+    PackedStateMap<partition_t>* state_partition, const AutomatonOptions& options) {
+  Automaton automaton;
+  automaton.macroActions_ = options.macroActions_;
+  auto& inverse = automaton.inverse_;
+
+  auto reachable = computeReachableStateSet(sim, init, options, perf_report);
+  uint32_t num_partitions;
+  auto partition = mooreRefine(sim, reachable, options, &num_partitions, perf_report);
+  automaton.numPartitions_ = num_partitions;
+  automaton.initialPartition_ = partition[reachable.find(sim.layout().pack(init))];
+  if (state_partition) {
+    state_partition->reserve(reachable.states_.size());
+    for (size_t s = 0; s < reachable.states_.size(); s++) {
+      state_partition->emplace(reachable.states_[s], partition[s]);
+    }
+  }
+
+  // Every state of a partition leads to the same partitions, so the
+  // quotient's transitions are those of any one of them, and each
+  // (partition, action) pair comes up once
+  {
+    auto perf = perf_report.phase("quotient");
+    TraceSpan trace("quotient");
+    std::vector<uint32_t> reps(num_partitions, NO_STATE);
+    for (size_t s = 0; s < reachable.states_.size(); s++) {
+      if (reps[partition[s]] == NO_STATE) reps[partition[s]] = s;
+    }
+    automaton.partitionReps_ = kj::heapArray<AdventurerState>(num_partitions);
+    for (partition_t p = 0; p < num_partitions; p++) {
+      automaton.partitionReps_[p] = sim.layout().unpack(reachable.states_[reps[p]]);
+    }
+    const auto codes = actionCodes(options.macroActions_);
+    std::vector<uint32_t> succ;
+    successorStates(sim, reachable, options, codes, reps.data(), num_partitions, &succ);
+
+    auto index = inverse.initIndex(num_partitions + 1);
+    std::fill(index.begin(), index.end(), 0);
+    for (auto t : succ) {
+      if (t != NO_STATE) index[partition[t] + 1]++;
+    }
+    for (partition_t p = 0; p < num_partitions; p++) index[p + 1] += index[p];
+    size_t inverse_size = index[num_partitions];
+    auto states = inverse.initStates(inverse_size);
+    auto actions = inverse.initActions(inverse_size);
+    std::vector<uint32_t> fill(index.begin(), index.end() - 1);
+    for (partition_t p = 0; p < num_partitions; p++) {
+      for (size_t j = 0; j < codes.size(); j++) {
+        uint32_t t = succ[p * codes.size() + j];
+        if (t == NO_STATE) continue;
+        uint32_t k = fill[partition[t]]++;
+        states[k] = p;
+        actions[k] = codes[j];
+      }
+    }
+    KJ_LOG(INFO, inverse_size, "reduced inverse transition matrix");
+    inverse.compress(num_partitions);
+    KJ_LOG(INFO, inverse.isNarrow(), "compressed inverse");
+  }
+
+  return automaton;
+}
+
+}  // namespace
+
+Automaton buildAutomaton(
+    Simulator& sim, AdventurerState init, PerfReport& perf_report,
+    PackedStateMap<partition_t>* state_partition, const AutomatonOptions& options) {
+  if (options.onTheFly_) {
+    return buildAutomatonOnTheFly(sim, init, perf_report, state_partition, options);
+  }
+  Automaton automaton;
+  automaton.macroActions_ = options.macroActions_;
+  auto& inverse = automaton.inverse_;
+
+  StateCode state_code;
+  HopcroftInput hopcroft_input;
+  {
+    auto [ inverse_map, inverse_size ] = options.horizon_
+        ? computeReachableStatesWithin(
+              sim, init, *options.horizon_, options.macroActions_, perf_report)
+        : computeReachableStates(sim, init, options.macroActions_, perf_report);
+    state_code = numberStates(inverse_map, perf_report);
+
+    // Minimize states
+    {
+      auto perf = perf_report.phase("hopcroft-input");
+      TraceSpan trace("hopcroft-input");
+      hopcroft_input.setNumStates(state_code.decode_.size());
+      hopcroft_input.setNumActions(options.macroActions_ ? NUM_ACTION_FRAGMENTS : NUM_ACTIONS);
+
+      {
+        auto& inverse = hopcroft_input.initInverse();
+        auto states = inverse.initStates(inverse_size);
+        auto actions = inverse.initActions(inverse_size);
+        auto index = inverse.initIndex(state_code.decode_.size() + 1);
+        size_t inverse_index = 0;
+        for (state_code_t i = 0; i < state_code.decode_.size(); i++) {
+          index[i] = inverse_index;
+          for (const auto& sa : inverse_map[state_code.decode_[i]]) {
+            states[inverse_index] = state_code.encode_[sa.first];
+            actions[inverse_index] = sa.second;
+            inverse_index++;
+          }
+        }
+        KJ_ASSERT(inverse_index == inverse_size, inverse_index, inverse_size);
+        index[state_code.decode_.size()] = inverse_index;
+      }
+
+      auto initialPartition = hopcroft_input.initInitialPartition(state_code.decode_.size());
+      AdventurerStateMap<partition_t> partition_map;
+      for (state_code_t i = 0; i < state_code.decode_.size(); i++) {
+        AdventurerState s = coarsenState(sim.layout().unpack(state_code.decode_[i]));
+        auto it = partition_map.find(s);
+        partition_t v;
+        if (it == partition_map.end()) {
+          v = partition_map.size();
+          partition_map.emplace(s, v);
+        } else {
+          v = it->second;
+        }
+        initialPartition[i] = v;
+      }
+      KJ_LOG(INFO, partition_map.size(), "initial number of partitions");
+    }
+  }
+  {
+    auto perf = perf_report.phase("hopcroft-compress");
+    hopcroft_input.initInverse().compress(hopcroft_input.getNumStates());
+  }
+  HopcroftOutput hopcroft_output;
+  {
+    auto perf = perf_report.phase("hopcroft");
+    hopcroft(hopcroft_input, &hopcroft_output);
+  }
+  auto partition = hopcroft_output.getPartition();
+  uint32_t numPartitions = hopcroft_output.getNumPartitions();
+  automaton.numPartitions_ = numPartitions;
+  automaton.initialPartition_ = partition[state_code.encode_[sim.layout().pack(init)]];
+  if (state_partition) {
+    state_partition->reserve(state_code.decode_.size());
+    for (state_code_t s = 0; s < state_code.decode_.size(); s++) {
+      state_partition->emplace(state_code.decode_[s], partition[s]);
+    }
+  }
+
+  // Redo inverse transition table for partitions
+  {
+    auto perf = perf_report.phase("quotient");
+    TraceSpan trace("quotient");
+    // Compute it first with shitty data structures.
+    // Even if states are equivalent, the states that feed to them
+    // may not be: equivalence is a statement about future
+    // evolution, not the past!
+    std::unordered_map<partition_t, std::unordered_set<std::pair<partition_t, action_code_t>>> inverse_map;
+    const auto& old_inverse = hopcroft_input.getInverse();
+    auto old_actions = old_inverse.getActions();
+    auto old_index = old_inverse.getIndex();
+    size_t inverse_size = 0;
+    automaton.partitionReps_ = kj::heapArray<AdventurerState>(numPartitions);
+    for (state_code_t s = 0; s < state_code.decode_.size(); s++) {
+      partition_t p = partition[s];
+      automaton.partitionReps_[p] = sim.layout().unpack(state_code.decode_[s]);  // last one wins
+      for (uint32_t i = old_index[s]; i < old_index[s+1]; i++) {
+        std::pair<partition_t, action_code_t> pair = {
+          partition[old_inverse.getState(i)],
+          old_actions[i]
+        };
+        auto r = inverse_map[p].emplace(pair);
+        if (r.second) {
+          inverse_size++;
+        }
+      }
+    }
+
+    // Pack the map now
+    auto states = inverse.initStates(inverse_size);
+    auto actions = inverse.initActions(inverse_size);
+    auto index = inverse.initIndex(numPartitions + 1);
+    size_t inverse_index = 0;
+    for (partition_t i = 0; i < numPartitions; i++) {
+      index[i] = inverse_index;
+      for (const auto& pa : inverse_map[i]) {
+        states[inverse_index] = pa.first;
+        actions[inverse_index] = pa.second;
+        inverse_index++;
+      }
+    }
+    KJ_ASSERT(inverse_index == inverse_size, inverse_index, inverse_size);
+    KJ_LOG(INFO, inverse_size, "reduced inverse transition matrix");
+    index[numPartitions] = inverse_index;
+    inverse.compress(numPartitions);
+    KJ_LOG(INFO, inverse.isNarrow(), "compressed inverse");
+  }
+
+  return automaton;
+}
+
+// Fingerprinting
+
+// Bump whenever the automaton construction or the file format changes
+static constexpr uint32_t AUTOMATON_VERSION = 4;
+
+uint64_t automatonFingerprint(
+    const Simulator& sim, AdventurerState init, const AutomatonOptions& options) {
+  // Everything in SimParams except the damage numbers.  The adventurer
+  // stands in for its EffectTable, and the weapon type for the kernel
+  // selected.
+  const auto& p = sim.params();
+  Fingerprint fp;
+  fp.add(AUTOMATON_VERSION);
+  fp.add(p.adventurer_);
+  fp.add(p.weaponType_);
+  fp.add(static_cast<uint64_t>(p.numSkills_));
+  fp.add(p.skillSp_);
+  fp.add(p.hitSp_);
+  fp.add(p.hitDelay_);
+  fp.add(p.next_);
+  fp.add(p.recoveryFrames_);
+  fp.add(p.startupFrames_);
+  fp.add(p.uiHiddenFrames_);
+  fp.add(p.s3BuffFrames_);
+  fp.add(p.timerBucket_);
+  fp.add(p.rounding_);
+  fp.add(p.spTolerance_);
+  fp.add(sim.layout().pack(init).words_);
+  // 0: unbounded
+  fp.add(options.horizon_ ? *options.horizon_ : frames_t(0));
+  fp.add(options.macroActions_);
+  return fp.h_;
+}
+
+// Cache file
+
+namespace {
+
+struct AutomatonFileHeader {
+  char magic_[8];
+  uint32_t version_;
+  uint32_t stateSize_;  // sizeof(AdventurerState)
+  uint64_t fingerprint_;
+  uint32_t numPartitions_;
+  uint32_t initialPartition_;
+  uint64_t inverseSize_;
+  uint32_t stateIndexSize_;  // 2 if the inverse is narrow, else 4
+  uint32_t macroActions_;  // 0 or 1
+};
+
+constexpr char AUTOMATON_MAGIC[8] = "DLGAUTO";
+
+// Offsets of each array in the file
+struct AutomatonFileLayout {
+  AutomatonFileLayout(uint64_t inverse_size, uint32_t state_index_size, uint32_t num_partitions) {
+    states_ = align8(sizeof(AutomatonFileHeader));
+    actions_ = align8(states_ + inverse_size * state_index_size);
+    index_ = align8(actions_ + inverse_size * sizeof(uint8_t));
+    reps_ = align8(index_ + (num_partitions + 1) * sizeof(uint32_t));
+    size_ = reps_ + num_partitions * sizeof(AdventurerState);
+  }
+  size_t states_, actions_, index_, reps_, size_;
+};
+
+}  // namespace
+
+void writeAutomaton(kj::StringPtr path, uint64_t fingerprint, const Automaton& automaton) {
+  TraceSpan trace("write-automaton");
+  const auto& inverse = automaton.inverse_;
+  auto actions = inverse.getActions();
+  auto index = inverse.getIndex();
+  uint32_t state_index_size = inverse.isNarrow() ? sizeof(uint16_t) : sizeof(uint32_t);
+  AutomatonFileLayout layout(inverse.size(), state_index_size, automaton.numPartitions_);
+
+  AutomatonFileHeader header;
+  memcpy(header.magic_, AUTOMATON_MAGIC, sizeof(header.magic_));
+  header.version_ = AUTOMATON_VERSION;
+  header.stateSize_ = sizeof(AdventurerState);
+  header.fingerprint_ = fingerprint;
+  header.numPartitions_ = automaton.numPartitions_;
+  header.initialPartition_ = automaton.initialPartition_;
+  header.inverseSize_ = inverse.size();
+  header.stateIndexSize_ = state_index_size;
+  header.macroActions_ = automaton.macroActions_;
+
+  // Write to a temporary and rename, so concurrent runs never see a
+  // partial file
+  auto tmp_path = kj::str(path, ".tmp.", getpid());
+  {
+    std::ofstream os(tmp_path.cStr(), std::ios::binary);
+    KJ_REQUIRE(os.good(), tmp_path, "could not open automaton cache file");
+    size_t pos = 0;
+    auto write = [&](size_t offset, const void* p, size_t n) {
+      static const char zeros[8] = {};
+      KJ_ASSERT(offset >= pos && offset - pos < 8);
+      os.write(zeros, offset - pos);
+      os.write(static_cast<const char*>(p), n);
+      pos = offset + n;
+    };
+    write(0, &header, sizeof(header));
+    inverse.visitStates([&](auto states) {
+      write(layout.states_, states.begin(), states.size() * state_index_size);
+    });
+    write(layout.actions_, actions.begin(), actions.size() * sizeof(uint8_t));
+    write(layout.index_, index.begin(), index.size() * sizeof(uint32_t));
+    write(layout.reps_, automaton.partitionReps_.begin(),
+          automaton.partitionReps_.size() * sizeof(AdventurerState));
+    KJ_ASSERT(pos == layout.size_, pos, layout.size_);
+    KJ_REQUIRE(os.good(), tmp_path, "could not write automaton cache file");
+  }
+  KJ_SYSCALL(rename(tmp_path.cStr(), path.cStr()), tmp_path, path);
+  KJ_LOG(INFO, path, layout.size_, "wrote automaton cache");
+}
+
+// Everything the DP indexes with is in range: a file that matches
+// its header's sizes could still be corrupt (or written by a buggy
+// build), and a bad partition or action would be read out of bounds
+static bool validAutomaton(
+    kj::byte* base, const AutomatonFileLayout& layout, const AutomatonFileHeader& header) {
+  const uint32_t num_partitions = header.numPartitions_;
+  const size_t num_codes = header.macroActions_ ? NUM_ACTION_FRAGMENTS : NUM_ACTIONS;
+  if (header.initialPartition_ >= num_partitions) return false;
+  auto index = mmapView<uint32_t>(base, layout.index_, num_partitions + 1);
+  if (index[0] != 0 || index[num_partitions] != header.inverseSize_) return false;
+  for (uint32_t p = 0; p < num_partitions; p++) {
+    if (index[p] > index[p + 1]) return false;
+  }
+  auto actions = mmapView<uint8_t>(base, layout.actions_, header.inverseSize_);
+  for (auto a : actions) {
+    if (a >= num_codes) return false;
+  }
+  auto states_in_range = [&](auto states) {
+    for (auto s : states) {
+      if (s >= num_partitions) return false;
+    }
+    return true;
+  };
+  bool ok = header.stateIndexSize_ == sizeof(uint16_t)
+    ? states_in_range(mmapView<uint16_t>(base, layout.states_, header.inverseSize_))
+    : states_in_range(mmapView<uint32_t>(base, layout.states_, header.inverseSize_));
+  if (!ok) return false;
+  auto reps = mmapView<AdventurerState>(base, layout.reps_, num_partitions);
+  for (const auto& st : reps) {
+    if (toIndex(st.afterAction_) >= NUM_AFTER_ACTIONS) return false;
+  }
+  return true;
+}
+
+std::optional<Automaton> loadAutomaton(kj::StringPtr path, uint64_t fingerprint) {
+  TraceSpan trace("load-automaton");
+  // Writable (copy on write) since PackedInverse hands out non-const
+  // arrays; nobody actually writes
+  auto mb_mapping = mmapFile(path, true);
+  if (!mb_mapping || mb_mapping->size() < sizeof(AutomatonFileHeader)) {
+    return std::nullopt;
+  }
+  size_t size = mb_mapping->size();
+
+  Automaton automaton;
+  automaton.backing_ = kj::mv(*mb_mapping);
+  auto* base = automaton.backing_.begin();
+
+  AutomatonFileHeader header;
+  memcpy(&header, base, sizeof(header));
+  if (memcmp(header.magic_, AUTOMATON_MAGIC, sizeof(header.magic_)) != 0 ||
+      header.version_ != AUTOMATON_VERSION ||
+      header.stateSize_ != sizeof(AdventurerState) ||
+      header.fingerprint_ != fingerprint) {
+    KJ_LOG(WARNING, path, "ignoring stale automaton cache file");
+    return std::nullopt;
+  }
+  if (header.stateIndexSize_ != sizeof(uint16_t) && header.stateIndexSize_ != sizeof(uint32_t)) {
+    KJ_LOG(WARNING, path, "ignoring corrupt automaton cache file");
+    return std::nullopt;
+  }
+  AutomatonFileLayout layout(header.inverseSize_, header.stateIndexSize_, header.numPartitions_);
+  if (layout.size_ != size) {
+    KJ_LOG(WARNING, path, layout.size_, size, "ignoring truncated automaton cache file");
+    return std::nullopt;
+  }
+
+  if (!validAutomaton(base, layout, header)) {
+    KJ_LOG(WARNING, path, "ignoring corrupt automaton cache file");
+    return std::nullopt;
+  }
+
+  automaton.numPartitions_ = header.numPartitions_;
+  automaton.initialPartition_ = header.initialPartition_;
+  automaton.macroActions_ = header.macroActions_ != 0;
+  if (header.stateIndexSize_ == sizeof(uint16_t)) {
+    automaton.inverse_.narrowStates_ = mmapView<uint16_t>(base, layout.states_, header.inverseSize_);
+    automaton.inverse_.narrow_ = true;
+  } else {
+    automaton.inverse_.states_ = mmapView<uint32_t>(base, layout.states_, header.inverseSize_);
+  }
+  automaton.inverse_.actions_ = mmapView<uint8_t>(base, layout.actions_, header.inverseSize_);
+  automaton.inverse_.index_ = mmapView<uint32_t>(base, layout.index_, header.numPartitions_ + 1);
+  automaton.partitionReps_ = mmapView<AdventurerState>(base, layout.reps_, header.numPartitions_);
+  KJ_LOG(INFO, path, header.numPartitions_, header.inverseSize_, "loaded automaton cache");
+  return std::move(automaton);
+}
+
+Automaton loadOrBuildAutomaton(
+    Simulator& sim, AdventurerState init, std::optional<kj::StringPtr> cache_dir,
+    PerfReport& perf_report, const AutomatonOptions& options) {
+  if (!cache_dir) {
+    return buildAutomaton(sim, init, perf_report, nullptr, options);
+  }
+  uint64_t fingerprint = automatonFingerprint(sim, init, options);
+  auto path = kj::str(*cache_dir, "/", kj::hex(fingerprint), ".automaton");
+  {
+    auto perf = perf_report.phase("load-automaton");
+    auto mb_automaton = loadAutomaton(path, fingerprint);
+    if (mb_automaton) return std::move(*mb_automaton);
+  }
+  auto automaton = buildAutomaton(sim, init, perf_report, nullptr, options);
+  // The cache is only an optimization: losing it must not lose the
+  // build
+  try {
+    writeAutomaton(path, fingerprint, automaton);
+  } catch (...) {
+    KJ_LOG(WARNING, path, kj::getCaughtExceptionAsKj(), "could not write automaton cache");
+  }
+  return automaton;
+}
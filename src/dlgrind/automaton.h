@@ -0,0 +1,119 @@
+#pragma once
+
+#include <dlgrind/action_string.h>
+#include <dlgrind/hopcroft.h>
+#include <dlgrind/perf_counters.h>
+#include <dlgrind/simulator.h>
+#include <dlgrind/state.h>
+
+#include <kj/array.h>
+#include <kj/string.h>
+
+#include <cstdint>
+#include <optional>
+
+using partition_t = uint32_t;
+using action_code_t = uint8_t;
+
+// The minimized state machine the DP runs over: every state reachable
+// from the initial state, up to equivalence, and for each of these
+// partitions the (partition, action) pairs that lead to it.
+//
+// None of this depends on damage, only on timings, SP and the
+// adventurer's effects, so it can be cached across runs that only
+// change modifiers (see automatonFingerprint).
+struct Automaton {
+  Automaton() {}
+  KJ_DISALLOW_COPY(Automaton);
+  Automaton(Automaton&&) = default;
+  Automaton& operator=(Automaton&&) = default;
+
+  // Backing storage (e.g., a mapped cache file) that the arrays below
+  // may point into; declared first so it is released last
+  kj::Array<kj::byte> backing_;
+
+  uint32_t numPartitions_ = 0;
+  partition_t initialPartition_ = 0;
+  // Action codes are ActionFragment codes rather than toIndex(Action):
+  // every edge is a whole combo (c1 ... c5fs), fs or skill, with its
+  // frames and damage summed.  An edge never continues the fragment
+  // before it (that is the longer fragment, from where it started),
+  // so mid-combo states are only left by skill cancels, and the DP
+  // takes one edge per fragment rather than one per hit.  See
+  // applyActionCode.
+  bool macroActions_ = false;
+  // Indexed by partition
+  PackedInverse inverse_;
+  // Some state in each partition
+  kj::Array<AdventurerState> partitionReps_;
+};
+
+struct AutomatonOptions {
+  // Only keep what rotations of fewer than horizon frames can reach or
+  // take, so the result is only good for DPs up to that horizon; for
+  // short horizons most of the closure is dropped before minimization
+  std::optional<frames_t> horizon_;
+  // See Automaton::macroActions_
+  bool macroActions_ = false;
+  // Never store the transitions between unminimized states: keep only
+  // the set of reachable states, and refine partitions by simulating
+  // the transitions again each round (Moore rather than Hopcroft).
+  // Slower, but peak memory is set by the states alone.  The result is
+  // the same automaton, up to the numbering of partitions, so it
+  // shares the cache.
+  bool onTheFly_ = false;
+};
+
+// Whether fragment f may follow a state that ended with after, with
+// macro actions: not if it would continue the combo
+inline bool macroActionAllowed(AfterAction after, ActionFragment f) {
+  bool starts_with_x = isCombo(f);
+  bool starts_with_fs = f == ActionFragment::FS;
+  switch (after) {
+    case AfterAction::AFTER_C1:
+    case AfterAction::AFTER_C2:
+    case AfterAction::AFTER_C3:
+    case AfterAction::AFTER_C4:
+      return !starts_with_x && !starts_with_fs;
+    case AfterAction::AFTER_C5:
+      return !starts_with_fs;
+    default:
+      return true;
+  }
+}
+
+// Simulator::applyAction for an action code of an automaton with or
+// without macro actions
+inline std::optional<AdventurerState> applyActionCode(
+    Simulator& sim, bool macro_actions, AdventurerState prev, action_code_t code,
+    frames_t* frames_out = nullptr, double* dmg_out = nullptr) {
+  if (!macro_actions) return sim.applyAction(prev, static_cast<Action>(code), frames_out, dmg_out);
+  auto f = static_cast<ActionFragment>(code);
+  if (!macroActionAllowed(prev.afterAction_, f)) return std::nullopt;
+  return sim.applyFragment(prev, f, frames_out, dmg_out);
+}
+
+// Reachability, Hopcroft minimization and the quotient inverse.  If
+// state_partition is given, it is filled with the partition of every
+// reachable state.
+Automaton buildAutomaton(
+    Simulator& sim, AdventurerState init, PerfReport& perf,
+    PackedStateMap<partition_t>* state_partition = nullptr,
+    const AutomatonOptions& options = {});
+
+// Hash of everything buildAutomaton's result depends on
+uint64_t automatonFingerprint(
+    const Simulator& sim, AdventurerState init, const AutomatonOptions& options = {});
+
+// A flat file: a header followed by the arrays of an Automaton, so
+// loading it is just mapping it.  Loading returns nullopt if the file
+// is missing or was written for a different fingerprint (or by an
+// incompatible build).
+void writeAutomaton(kj::StringPtr path, uint64_t fingerprint, const Automaton& automaton);
+std::optional<Automaton> loadAutomaton(kj::StringPtr path, uint64_t fingerprint);
+
+// buildAutomaton, going through <cache_dir>/<fingerprint>.automaton if
+// a cache directory is given
+Automaton loadOrBuildAutomaton(
+    Simulator& sim, AdventurerState init, std::optional<kj::StringPtr> cache_dir,
+    PerfReport& perf, const AutomatonOptions& options = {});
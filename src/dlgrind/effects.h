@@ -0,0 +1,203 @@
+#pragma once
+
+#include <dlgrind/schema.capnp.h>
+#include <dlgrind/state.h>
+
+#include <array>
+#include <cstdint>
+
+// Declarative description of what an adventurer's skills and hits do
+// to the state beyond the basic SP/combo machinery, and how the
+// resulting buffs and counters affect damage.
+//
+// Tables are constexpr, so the simulator kernels (which are
+// specialized per adventurer) evaluate them with all the "does this
+// adventurer have X" checks folded away.  The same tables tell
+// StateLayout which fields of AdventurerState an adventurer can
+// ever touch, and how large they get.
+
+enum class EffectOp : uint8_t {
+  NONE,
+  // Refresh buff slot 1, moving a still active buff into slot 0 (see
+  // buffAllowDoubleStack)
+  BUFF_DOUBLE_STACK,
+  BUFF,
+  FS_BUFF,
+  AFFLICTION,
+};
+
+struct Effect {
+  EffectOp op_ = EffectOp::NONE;
+  uint8_t slot_ = 0;  // BUFF only
+  frames_t frames_ = 0;
+};
+
+enum class DmgCondition : uint8_t {
+  NONE,  // unused entry
+  SKILL_SHIFT,  // skillShift_ of the skill is arg_
+  FS_BUFF,  // fsBuff_ is set
+  NO_AFFLICTION,  // afflictionFramesLeft_ is zero
+};
+
+// Replaces the damage mod of the hit leading to after_, if the
+// condition holds.  The first matching entry wins.
+struct DmgOverride {
+  AfterAction after_ = AfterAction::AFTER_NOTHING;
+  DmgCondition cond_ = DmgCondition::NONE;
+  uint8_t arg_ = 0;
+  double mod_ = 0;
+};
+
+constexpr size_t MAX_EFFECTS = 2;
+constexpr size_t MAX_DMG_OVERRIDES = 3;
+
+struct EffectTable {
+  // Applied after each skill (indexed by skill)
+  std::array<std::array<Effect, MAX_EFFECTS>, 3> onSkill_ = {};
+  // Applied after every hit
+  std::array<Effect, MAX_EFFECTS> onHit_ = {};
+
+  // Strength multiplier while each buff slot is active (1 if none)
+  std::array<double, 3> strengthBuff_ = {1, 1, 1};
+  std::array<DmgOverride, MAX_DMG_OVERRIDES> dmgOverrides_ = {};
+  // Multiplier while the enemy is afflicted (1 if none)
+  double punisher_ = 1;
+
+  // Energy: each skill hit adds energyGain_[skill][skill shift], up to
+  // energyMax_; the hit after that consumes it.  Reaching the maximum
+  // triggers the energized buff.  energyMax_ == 0 disables energy.
+  uint8_t energyMax_ = 0;
+  std::array<std::array<uint8_t, 3>, 3> energyGain_ = {};
+  double energizedDmg_ = 1;
+  uint8_t energizedBuffSlot_ = 0;
+  frames_t energizedBuffFrames_ = 0;
+
+  // Number of forms each of S1/S2 cycles through (0 if it doesn't)
+  std::array<uint8_t, 2> skillShiftCycle_ = {0, 0};
+
+  uint8_t skillPrep_ = 0;  // default, percentage
+};
+
+constexpr EffectTable adventurerEffects(AdventurerName name) {
+  EffectTable t;
+  switch (name) {
+    case AdventurerName::HEINWALD:
+      t.onSkill_[1][0] = {EffectOp::BUFF_DOUBLE_STACK, 0, 10 * 60};
+      t.strengthBuff_ = {1.2, 1.2, 1};
+      t.skillPrep_ = 100;
+      break;
+    case AdventurerName::AMANE:
+      t.onSkill_[1][0] = {EffectOp::BUFF_DOUBLE_STACK, 0, 10 * 60};
+      t.strengthBuff_ = {1.15, 1.15, 1};
+      t.skillPrep_ = 75;
+      break;
+    case AdventurerName::ANNELIE:
+      // Energized: Strength +20% for 15s
+      t.strengthBuff_ = {1.20, 1, 1};
+      t.energyMax_ = 5;
+      t.energyGain_[0] = {1, 2, 0};
+      t.energyGain_[1] = {2, 2, 2};
+      t.energizedDmg_ = 1.5;
+      t.energizedBuffSlot_ = 0;
+      t.energizedBuffFrames_ = 15 * 60;
+      t.skillShiftCycle_ = {3, 0};
+      t.dmgOverrides_[0] = {AfterAction::AFTER_S1, DmgCondition::SKILL_SHIFT, 0, .1 + 8.14};
+      t.dmgOverrides_[1] = {AfterAction::AFTER_S1, DmgCondition::SKILL_SHIFT, 1, .1 * 2 + 2 * 4.07};
+      t.dmgOverrides_[2] = {AfterAction::AFTER_S1, DmgCondition::SKILL_SHIFT, 2, .1 * 3 + 3 * 3.54};
+      break;
+    case AdventurerName::YACHIYO:
+      t.onSkill_[1][0] = {EffectOp::FS_BUFF, 0, 0};
+      // NB: Assuming that the 5s is never relevant
+      t.onHit_[0] = {EffectOp::BUFF_DOUBLE_STACK, 0, 10 * 60};
+      t.onHit_[1] = {EffectOp::AFFLICTION, 0, 13 * 60};
+      t.dmgOverrides_[0] = {AfterAction::AFTER_FS, DmgCondition::FS_BUFF, 0, 7.82};
+      // TODO: Assume para procs on first hit (then you get paralysis
+      // buff)
+      t.dmgOverrides_[1] = {AfterAction::AFTER_S1, DmgCondition::NO_AFFLICTION, 0, 4.32 * 2};
+      t.punisher_ = 1.2;  // paralyzed punisher
+      break;
+    default:
+      break;
+  }
+  return t;
+}
+
+inline AdventurerState applyEffect(AdventurerState after, const Effect& e) {
+  switch (e.op_) {
+    case EffectOp::NONE:
+      break;
+    case EffectOp::BUFF_DOUBLE_STACK:
+      // Uses up both buff slots
+      if (after.buffFramesLeft_[1] > 0) {
+        after.buffFramesLeft_[0] = after.buffFramesLeft_[1];
+      }
+      after.buffFramesLeft_[1] = e.frames_;
+      break;
+    case EffectOp::BUFF:
+      after.buffFramesLeft_[e.slot_] = e.frames_;
+      break;
+    case EffectOp::FS_BUFF:
+      after.fsBuff_ = 1;
+      break;
+    case EffectOp::AFFLICTION:
+      after.afflictionFramesLeft_ = e.frames_;
+      break;
+  }
+  return after;
+}
+
+// Largest value each state field can take, given the effects and the
+// parts of the config they depend on.  Fields nobody touches are 0,
+// and so take no space in a PackedState.
+inline StateFieldMax stateFieldMax(
+    const EffectTable& t,
+    size_t num_skills,
+    const std::array<uint16_t, 3>& skill_sp,
+    frames_t ui_hidden_frames,
+    frames_t s3_buff_frames) {
+  StateFieldMax m = {};
+  auto set = [&](StateField f, uint32_t v) {
+    auto& x = m[static_cast<size_t>(f)];
+    if (v > x) x = v;
+  };
+  set(StateField::AFTER_ACTION, NUM_AFTER_ACTIONS - 1);
+  set(StateField::UI_HIDDEN, ui_hidden_frames);
+  set(StateField::ENERGY, t.energyMax_);
+  for (size_t k = 0; k < 2; k++) {
+    if (t.skillShiftCycle_[k]) {
+      set(static_cast<StateField>(static_cast<size_t>(StateField::SKILL_SHIFT0) + k), t.skillShiftCycle_[k] - 1);
+    }
+  }
+  for (size_t k = 0; k < num_skills; k++) {
+    set(static_cast<StateField>(static_cast<size_t>(StateField::SP0) + k), skill_sp[k]);
+  }
+  auto buff = [&](size_t slot, frames_t frames) {
+    set(static_cast<StateField>(static_cast<size_t>(StateField::BUFF0) + slot), frames);
+  };
+  auto effect = [&](const Effect& e) {
+    switch (e.op_) {
+      case EffectOp::NONE:
+        break;
+      case EffectOp::BUFF_DOUBLE_STACK:
+        buff(0, e.frames_);
+        buff(1, e.frames_);
+        break;
+      case EffectOp::BUFF:
+        buff(e.slot_, e.frames_);
+        break;
+      case EffectOp::FS_BUFF:
+        set(StateField::FS_BUFF, 1);
+        break;
+      case EffectOp::AFFLICTION:
+        set(StateField::AFFLICTION, e.frames_);
+        break;
+    }
+  };
+  for (size_t k = 0; k < num_skills; k++) {
+    for (const auto& e : t.onSkill_[k]) effect(e);
+  }
+  for (const auto& e : t.onHit_) effect(e);
+  if (t.energyMax_) buff(t.energizedBuffSlot_, t.energizedBuffFrames_);
+  if (num_skills > 2 && s3_buff_frames) buff(2, s3_buff_frames);
+  return m;
+}
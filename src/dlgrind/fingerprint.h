@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// FNV-1a, for keying caches on their inputs.  Stable across runs (it
+// ends up in file names), unlike std::hash.
+struct Fingerprint {
+  uint64_t h_ = 0xcbf29ce484222325ULL;
+  void add(const void* p, size_t n) {
+    auto* b = static_cast<const uint8_t*>(p);
+    for (size_t i = 0; i < n; i++) {
+      h_ ^= b[i];
+      h_ *= 0x100000001b3ULL;
+    }
+  }
+  // Only for types without padding
+  template <typename T>
+  void add(const T& v) {
+    static_assert(std::is_trivially_copyable<T>::value, "");
+    add(&v, sizeof(v));
+  }
+};
@@ -1,5 +1,7 @@
 #include <dlgrind/hopcroft.h>
+#include <dlgrind/trace.h>
 
+#include <algorithm>
 #include <iostream>
 #include <unordered_set>
 #include <unordered_map>
@@ -39,12 +41,37 @@ struct Partition {
   std::unordered_set<state_t> states_;
 };
 
-void hopcroft(const HopcroftInput& input, HopcroftOutput* output) {
+void PackedInverse::compress(uint32_t num_states) {
+  KJ_REQUIRE(!narrow_, "already compressed");
+  std::vector<uint64_t> edges;
+  for (size_t s = 0; s + 1 < index_.size(); s++) {
+    edges.clear();
+    for (uint32_t i = index_[s]; i < index_[s+1]; i++) {
+      edges.push_back(uint64_t(states_[i]) << 8 | actions_[i]);
+    }
+    std::sort(edges.begin(), edges.end());
+    for (uint32_t i = index_[s]; i < index_[s+1]; i++) {
+      states_[i] = edges[i - index_[s]] >> 8;
+      actions_[i] = edges[i - index_[s]] & 0xFF;
+    }
+  }
+  if (num_states <= 1 << 16) {
+    narrowStates_ = kj::heapArray<uint16_t>(states_.size());
+    std::copy(states_.begin(), states_.end(), narrowStates_.begin());
+    states_ = nullptr;
+    narrow_ = true;
+  }
+}
+
+template <typename StateIndex>
+static void hopcroftImpl(
+    const HopcroftInput& input, kj::ArrayPtr<const StateIndex> inverseStates,
+    HopcroftOutput* output) {
+  TraceSpan trace("hopcroft");
   auto numStates = input.getNumStates();
   auto numActions = input.getNumActions();
-  KJ_LOG(INFO, numStates, numActions);
+  KJ_LOG(INFO, numStates, numActions, sizeof(StateIndex));
   const auto& inverse = input.getInverse();
-  auto inverseStates = inverse.getStates();
   auto inverseActions = inverse.getActions();
   auto inverseIndex = inverse.getIndex();
 
@@ -179,3 +206,9 @@ void hopcroft(const HopcroftInput& input, HopcroftOutput* output) {
     partition[s] = states[s].partition_;
   }
 }
+
+void hopcroft(const HopcroftInput& input, HopcroftOutput* output) {
+  input.getInverse().visitStates([&](auto inverseStates) {
+    hopcroftImpl(input, inverseStates, output);
+  });
+}
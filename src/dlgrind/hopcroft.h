@@ -5,22 +5,53 @@
 #include <vector>
 #include <cstdint>
 
+// Inverse transition table in CSR form: the predecessors of state s
+// are states[index[s]..index[s+1]), each reaching s by the action in
+// the same position of actions.
+//
+// After compress(), each state's predecessors are sorted (so the DP
+// walks the table it reads from in order), and if every state id fits
+// in 16 bits they are stored in narrowStates_ instead of states_,
+// halving the bytes the DP streams per edge.  Kernels that read the
+// states in their inner loop go through visitStates, and so are
+// instantiated for both widths.
 struct PackedInverse {
   PackedInverse() {}
 
   KJ_DISALLOW_COPY(PackedInverse);
+  PackedInverse(PackedInverse&&) = default;
+  PackedInverse& operator=(PackedInverse&&) = default;
 
   kj::Array<uint32_t> states_;
+  kj::Array<uint16_t> narrowStates_;
+  bool narrow_ = false;
   kj::Array<uint8_t> actions_;
   kj::Array<uint32_t> index_;
 
-  kj::ArrayPtr<const uint32_t> getStates() const { return states_; }
+  bool isNarrow() const { return narrow_; }
+  size_t size() const { return actions_.size(); }
+  uint32_t getState(size_t i) const { return narrow_ ? narrowStates_[i] : states_[i]; }
   kj::ArrayPtr<const uint8_t> getActions() const { return actions_; }
   kj::ArrayPtr<const uint32_t> getIndex() const { return index_; }
 
-  kj::ArrayPtr<uint32_t> initStates(size_t n) { states_ = kj::heapArray<uint32_t>(n); return states_; }
+  // f(kj::ArrayPtr<const T> states), with T the width in use
+  template <typename F>
+  decltype(auto) visitStates(F&& f) const {
+    if (narrow_) return f(kj::ArrayPtr<const uint16_t>(narrowStates_));
+    return f(kj::ArrayPtr<const uint32_t>(states_));
+  }
+
+  kj::ArrayPtr<uint32_t> initStates(size_t n) {
+    states_ = kj::heapArray<uint32_t>(n);
+    narrowStates_ = nullptr;
+    narrow_ = false;
+    return states_;
+  }
   kj::ArrayPtr<uint8_t> initActions(size_t n) { actions_ = kj::heapArray<uint8_t>(n); return actions_; }
   kj::ArrayPtr<uint32_t> initIndex(size_t n) { index_ = kj::heapArray<uint32_t>(n); return index_; }
+
+  // Sort predecessors, and narrow if num_states allows
+  void compress(uint32_t num_states);
 };
 
 struct HopcroftInput {
@@ -0,0 +1,273 @@
+#include <dlgrind/improve.h>
+#include <dlgrind/action_string.h>
+#include <dlgrind/trace.h>
+
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <sstream>
+
+namespace {
+
+// As in the DP
+constexpr double EPSILON = 0.01;
+
+using Fragments = std::vector<ActionFragment>;
+
+bool isSkill(ActionFragment f) {
+  return f == ActionFragment::S1 || f == ActionFragment::S2 || f == ActionFragment::S3;
+}
+
+void appendActions(ActionFragment f, std::vector<Action>* out) {
+  forEachAction(f, [&](Action a) { out->push_back(a); });
+}
+
+// Coalesced as the DP prints them (so c2 c3 is c5)
+Fragments toFragments(const std::vector<Action>& actions) {
+  Fragments r;
+  for (auto a : actions) {
+    if (!r.empty()) {
+      if (auto f = ActionString::coalesce(r.back(), a)) {
+        r.back() = *f;
+        continue;
+      }
+    }
+    r.push_back(ActionString::fragment(a));
+  }
+  return r;
+}
+
+std::string toString(const Fragments& fragments) {
+  std::ostringstream os;
+  for (auto f : fragments) os << fragmentString(f);
+  return os.str();
+}
+
+struct Score {
+  bool valid_ = false;
+  double dmg_ = 0;
+  frames_t frames_ = 0;
+
+  // More damage, then fewer frames
+  bool betterThan(const Score& o) const {
+    if (!valid_) return false;
+    if (!o.valid_) return true;
+    if (dmg_ > o.dmg_ + EPSILON) return true;
+    return dmg_ > o.dmg_ - EPSILON && frames_ < o.frames_;
+  }
+};
+
+// A rotation with the state, frames and damage before each of its
+// fragments (and after the last)
+struct Snapshots {
+  Fragments fragments_;
+  std::vector<AdventurerState> states_;
+  std::vector<frames_t> frames_;
+  std::vector<double> dmg_;
+  Score score_;
+};
+
+// Simulate fragments[from..] after snapshot from of base (whose first
+// from fragments must agree), stopping before the first action that
+// would reach the horizon.  If kept is given, the actions simulated
+// are appended to it.
+Score simulateFrom(
+    Simulator& sim, const Snapshots& base, const Fragments& fragments, size_t from,
+    frames_t horizon, std::vector<Action>* kept = nullptr) {
+  AdventurerState st = base.states_[from];
+  Score r{true, base.dmg_[from], base.frames_[from]};
+  std::vector<Action> actions;
+  for (size_t i = from; i < fragments.size(); i++) {
+    actions.clear();
+    appendActions(fragments[i], &actions);
+    for (auto a : actions) {
+      frames_t frames;
+      double dmg;
+      auto next = sim.applyAction(st, a, &frames, &dmg);
+      if (!next) return Score{};
+      if (r.frames_ + frames >= horizon) return r;
+      st = *next;
+      r.frames_ += frames;
+      r.dmg_ += dmg;
+      if (kept) kept->push_back(a);
+    }
+  }
+  return r;
+}
+
+// Cut fragments to the horizon, coalesce them, and snapshot every
+// fragment boundary
+Snapshots snapshot(
+    Simulator& sim, AdventurerState init, const Fragments& fragments, frames_t horizon) {
+  Snapshots empty;
+  empty.states_ = {init};
+  empty.frames_ = {0};
+  empty.dmg_ = {0};
+  std::vector<Action> kept;
+  auto score = simulateFrom(sim, empty, fragments, 0, horizon, &kept);
+
+  Snapshots r;
+  r.fragments_ = toFragments(kept);
+  r.score_ = score;
+  AdventurerState st = init;
+  frames_t total_frames = 0;
+  double total_dmg = 0;
+  std::vector<Action> actions;
+  for (auto f : r.fragments_) {
+    r.states_.push_back(st);
+    r.frames_.push_back(total_frames);
+    r.dmg_.push_back(total_dmg);
+    actions.clear();
+    appendActions(f, &actions);
+    for (auto a : actions) {
+      frames_t frames;
+      double dmg;
+      auto next = sim.applyAction(st, a, &frames, &dmg);
+      KJ_ASSERT(!!next);
+      st = *next;
+      total_frames += frames;
+      total_dmg += dmg;
+    }
+  }
+  r.states_.push_back(st);
+  r.frames_.push_back(total_frames);
+  r.dmg_.push_back(total_dmg);
+  return r;
+}
+
+// An edit of the current rotation: the rotation after it, and the
+// first fragment it changes
+struct Candidate {
+  Fragments fragments_;
+  size_t from_;
+};
+
+std::vector<Candidate> neighbours(const Fragments& cur, size_t num_skills) {
+  std::vector<Candidate> r;
+  const size_t n = cur.size();
+  auto with = [&](size_t from, auto&& edit) {
+    Candidate c{cur, from};
+    edit(c.fragments_);
+    r.push_back(std::move(c));
+  };
+
+  std::vector<ActionFragment> inserts = {ActionFragment::FS};
+  for (int length = 1; length <= 5; length++) {
+    inserts.push_back(combo(length, false));
+    inserts.push_back(combo(length, true));
+  }
+  for (size_t k = 0; k < num_skills; k++) {
+    inserts.push_back(ActionString::i2f(ActionString::f2i(ActionFragment::S1) + k));
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    auto f = cur[i];
+    // Swap with the next one
+    if (i + 1 < n && cur[i + 1] != f) {
+      with(i, [&](Fragments& e) { std::swap(e[i], e[i + 1]); });
+    }
+    // Lengthen or shorten a combo, or add or drop its force strike
+    if (isCombo(f)) {
+      int length = comboLength(f);
+      bool fs = comboFs(f);
+      if (length < 5) with(i, [&](Fragments& e) { e[i] = combo(length + 1, fs); });
+      if (length > 1) with(i, [&](Fragments& e) { e[i] = combo(length - 1, fs); });
+      with(i, [&](Fragments& e) { e[i] = combo(length, !fs); });
+      if (length == 1 && fs) with(i, [&](Fragments& e) { e[i] = ActionFragment::FS; });
+    } else if (f == ActionFragment::FS) {
+      with(i, [&](Fragments& e) { e[i] = combo(1, true); });
+    }
+    // Move a skill earlier
+    if (isSkill(f)) {
+      for (size_t j = 0; j < i; j++) {
+        with(j, [&](Fragments& e) {
+          e.erase(e.begin() + i);
+          e.insert(e.begin() + j, f);
+        });
+      }
+    }
+    with(i, [&](Fragments& e) { e.erase(e.begin() + i); });
+  }
+  // Insert anything anywhere (including at the end, which only helps
+  // while the rotation is short of the horizon)
+  for (size_t i = 0; i <= n; i++) {
+    for (auto f : inserts) {
+      with(i, [&](Fragments& e) { e.insert(e.begin() + i, f); });
+    }
+  }
+  return r;
+}
+
+}  // namespace
+
+Improvement improveRotation(
+    Simulator& sim, AdventurerState init, const std::vector<Action>& start,
+    PerfReport& perf_report, const std::function<void(const Improvement&)>& on_improvement,
+    const ImproveOptions& options) {
+  auto perf = perf_report.phase("improve");
+  const frames_t horizon = options.horizon_;
+  const size_t num_skills = sim.params().numSkills_;
+  const auto deadline = std::chrono::steady_clock::now() + options.budget_;
+  std::mt19937_64 rng(options.seed_);
+
+  auto cur = snapshot(sim, init, toFragments(start), horizon);
+  KJ_REQUIRE(cur.score_.valid_, "the starting rotation is illegal");
+  Snapshots best = cur;
+  auto report = [&]() {
+    on_improvement({toString(best.fragments_), static_cast<float>(best.score_.dmg_),
+                    best.score_.frames_});
+  };
+  report();
+
+  size_t rounds = 0;
+  size_t kicks = 0;
+  while (std::chrono::steady_clock::now() < deadline) {
+    TraceSpan trace("improve-round", rounds);
+    rounds++;
+    auto candidates = neighbours(cur.fragments_, num_skills);
+    std::vector<Score> scores(candidates.size());
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (size_t i = 0; i < candidates.size(); i++) {
+      scores[i] = simulateFrom(sim, cur, candidates[i].fragments_, candidates[i].from_, horizon);
+    }
+
+    // Lowest index among the best, so a seed gives one answer
+    size_t pick = candidates.size();
+    Score pick_score = cur.score_;
+    for (size_t i = 0; i < candidates.size(); i++) {
+      if (scores[i].betterThan(pick_score)) {
+        pick = i;
+        pick_score = scores[i];
+      }
+    }
+
+    if (pick < candidates.size()) {
+      cur = snapshot(sim, init, candidates[pick].fragments_, horizon);
+      if (cur.score_.betterThan(best.score_)) {
+        best = cur;
+        report();
+      }
+      continue;
+    }
+
+    // Local optimum: kick the best rotation with a few random (legal)
+    // edits and climb from there
+    kicks++;
+    cur = best;
+    std::uniform_int_distribution<int> num_edits(2, 4);
+    for (int k = num_edits(rng), attempts = 0; k > 0 && attempts < 100; attempts++) {
+      auto kick = neighbours(cur.fragments_, num_skills);
+      if (kick.empty()) break;
+      std::uniform_int_distribution<size_t> which(0, kick.size() - 1);
+      auto next = snapshot(sim, init, kick[which(rng)].fragments_, horizon);
+      if (!next.score_.valid_ || next.fragments_.empty()) continue;
+      cur = std::move(next);
+      k--;
+    }
+  }
+  KJ_LOG(INFO, rounds, kicks, best.score_.dmg_, "local search done");
+
+  return {toString(best.fragments_), static_cast<float>(best.score_.dmg_), best.score_.frames_};
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <dlgrind/optimizer.h>
+#include <dlgrind/perf_counters.h>
+#include <dlgrind/simulator.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Local search over rotations: a cheap, anytime way to polish a
+// rotation where the exact DP is too expensive (long horizons, big
+// configs), with no optimality guarantee.
+//
+// The rotation is edited a fragment (c5, c3fs, s1, ...) at a time:
+// swapping neighbours, lengthening or shortening a combo, adding or
+// dropping a force strike, inserting or removing a fragment, and
+// moving a skill earlier.  Each round evaluates every such edit of the
+// current rotation in parallel and takes the best; at a local optimum,
+// a few random edits kick it somewhere else.  A rotation that runs
+// past the horizon is cut at the last action that fits, so edits that
+// lengthen it are still worth trying.
+//
+// Edits are simulated from the state before the first fragment they
+// change, which is kept for every fragment of the current rotation.
+
+struct ImproveOptions {
+  // Rotations must take fewer frames than this
+  frames_t horizon_ = 3600;
+  std::chrono::milliseconds budget_ = std::chrono::seconds(10);
+  uint64_t seed_ = 0;
+};
+
+// Calls on_improvement with the starting rotation (cut to fit), then
+// every time the best one found improves.  Returns the best.
+Improvement improveRotation(
+    Simulator& sim, AdventurerState init, const std::vector<Action>& start, PerfReport& perf,
+    const std::function<void(const Improvement&)>& on_improvement,
+    const ImproveOptions& options = {});
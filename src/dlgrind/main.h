@@ -2,6 +2,17 @@
 
 #include <dlgrind/schema.capnp.h>
 #include <dlgrind/simulator.h>
+#include <dlgrind/perf_counters.h>
+#include <dlgrind/trace.h>
+#include <dlgrind/mmap.h>
+
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iostream>
 
 class DLGrind {
 protected:
@@ -13,6 +24,21 @@ protected:
     return true;
   }
 
+  kj::MainBuilder::Validity setBundle(kj::StringPtr bundle_fn) {
+    bundleFile_ = bundle_fn;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setEntry(kj::StringPtr entry) {
+    entry_ = entry;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setVariant(kj::StringPtr variant) {
+    variant_ = variant;
+    return true;
+  }
+
   kj::MainBuilder::Validity setSkillPrep(kj::StringPtr percentage) {
     skill_prep_ = percentage.parseAs<uint8_t>();
     return true;
@@ -23,7 +49,38 @@ protected:
     return true;
   }
 
+  kj::MainBuilder::Validity setPerfCounters() {
+    perf_.setEnabled(true);
+    return true;
+  }
+
+  void printPerfCounters() {
+    if (perf_.enabled()) perf_.print(std::cerr);
+  }
+
+  kj::MainBuilder::Validity setTrace(kj::StringPtr trace_fn) {
+    traceFile_ = trace_fn;
+    Tracer::global().setEnabled(true);
+    return true;
+  }
+
+  void writeTrace() {
+    if (!traceFile_) return;
+    std::ofstream os(traceFile_->cStr());
+    KJ_REQUIRE(os.good(), *traceFile_, "could not open trace file");
+    Tracer::global().writeChromeTrace(os);
+  }
+
   void readConfig() {
+    auto perf = perf_.phase("read-config");
+    TraceSpan trace("read-config");
+
+    if (bundleFile_) {
+      sim_.setConfig(readBundleConfig());
+      return;
+    }
+    KJ_REQUIRE(!entry_ && !variant_, "--entry and --variant need --bundle");
+
     int fd;
     const char* fn;
     if (!configFile_) {
@@ -39,8 +96,68 @@ protected:
     close(fd);
   }
 
+  // The selected entry of a ConfigSet, read in place from the mapped
+  // bundle (only a variant needs a copy)
+  kj::Own<Config::Reader> readBundleConfig() {
+    auto mb_mapping = mmapFile(*bundleFile_);
+    KJ_REQUIRE(!!mb_mapping, *bundleFile_, "could not open bundle");
+    auto mapping = kj::mv(*mb_mapping);
+    KJ_REQUIRE(mapping.size() % sizeof(capnp::word) == 0, *bundleFile_, "not a bundle");
+    auto reader = kj::heap<capnp::FlatArrayMessageReader>(kj::arrayPtr(
+        reinterpret_cast<const capnp::word*>(mapping.begin()),
+        mapping.size() / sizeof(capnp::word)));
+    auto entries = reader->getRoot<ConfigSet>().getEntries();
+
+    // By name, then by index
+    std::optional<size_t> mb_index;
+    if (!entry_) {
+      KJ_REQUIRE(entries.size() == 1, entries.size(), "bundle has several entries; pick one with --entry");
+      mb_index = 0;
+    } else {
+      for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].getName() == *entry_) {
+          mb_index = i;
+          break;
+        }
+      }
+      if (!mb_index && entry_->size() &&
+          std::all_of(entry_->begin(), entry_->end(), [](char c) { return isdigit(c); })) {
+        mb_index = entry_->parseAs<size_t>();
+      }
+      KJ_REQUIRE(!!mb_index && *mb_index < entries.size(), *entry_, "no such entry in bundle");
+    }
+    auto entry = entries[*mb_index];
+    KJ_LOG(INFO, *bundleFile_, entry.getName(), "bundle entry");
+
+    if (!variant_) {
+      return kj::heap<Config::Reader>(entry.getConfig())
+        .attach(kj::mv(reader), kj::mv(mapping));
+    }
+    for (auto variant : entry.getVariants()) {
+      if (variant.getName() != *variant_) continue;
+      auto builder = kj::heap<capnp::MallocMessageBuilder>();
+      builder->setRoot(entry.getConfig());
+      auto adventurer = builder->getRoot<Config>().getAdventurer();
+      if (variant.hasModifiers()) {
+        adventurer.setModifiers(variant.getModifiers());
+      }
+      if (variant.hasCoabilityModifiers()) {
+        adventurer.setCoabilityModifiers(variant.getCoabilityModifiers());
+      }
+      auto config = builder->getRoot<Config>().asReader();
+      KJ_LOG(INFO, *variant_, config, "bundle variant");
+      return kj::heap<Config::Reader>(config).attach(kj::mv(builder));
+    }
+    KJ_FAIL_REQUIRE(*variant_, "no such variant in bundle entry");
+  }
+
   Simulator sim_;
   kj::ProcessContext& context_;
   std::optional<kj::StringPtr> configFile_;
+  std::optional<kj::StringPtr> traceFile_;
+  std::optional<kj::StringPtr> bundleFile_;
+  std::optional<kj::StringPtr> entry_;
+  std::optional<kj::StringPtr> variant_;
   std::optional<uint8_t> skill_prep_;
+  PerfReport perf_;
 };
@@ -0,0 +1,54 @@
+#include <dlgrind/mmap.h>
+
+#include <kj/debug.h>
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+class MunmapDisposer : public kj::ArrayDisposer {
+protected:
+  void disposeImpl(void* firstElement, size_t elementSize, size_t elementCount,
+                   size_t capacity, void (*destroyElement)(void*)) const override {
+    munmap(firstElement, elementSize * elementCount);
+  }
+public:
+  static const MunmapDisposer instance;
+};
+
+const MunmapDisposer MunmapDisposer::instance;
+
+}  // namespace
+
+std::optional<kj::Array<kj::byte>> mmapFile(kj::StringPtr path, bool writable) {
+  int fd = open(path.cStr(), O_RDONLY);
+  if (fd < 0) return std::nullopt;
+  struct stat st;
+  KJ_SYSCALL(fstat(fd, &st), path);
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return kj::Array<kj::byte>();
+  }
+  int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  void* p = mmap(nullptr, size, prot, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap", errno, path);
+  }
+  return kj::Array<kj::byte>(static_cast<kj::byte*>(p), size, MunmapDisposer::instance);
+}
+
+kj::Array<kj::byte> mmapShared(size_t size) {
+  if (size == 0) return kj::Array<kj::byte>();
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap", errno, size);
+  }
+  return kj::Array<kj::byte>(static_cast<kj::byte*>(p), size, MunmapDisposer::instance);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <kj/array.h>
+#include <kj/string.h>
+
+#include <optional>
+
+// Map a whole file into memory; it stays mapped as long as the array
+// lives.  nullopt if the file cannot be opened.  A writable mapping is
+// private (copy on write), so writes never reach the file.
+std::optional<kj::Array<kj::byte>> mmapFile(kj::StringPtr path, bool writable = false);
+
+// Flat files keep each array 8-aligned, so it can be used in place
+inline size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+// An array that points into backing storage (e.g., a mapping) owned
+// elsewhere
+template <typename T>
+kj::Array<T> mmapView(kj::byte* base, size_t offset, size_t n) {
+  return kj::Array<T>(reinterpret_cast<T*>(base + offset), n, kj::NullArrayDisposer::instance);
+}
+
+// Zeroed anonymous memory, shared with processes forked while the
+// array lives (rather than copied on write)
+kj::Array<kj::byte> mmapShared(size_t size);
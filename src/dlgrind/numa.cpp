@@ -0,0 +1,85 @@
+#include <dlgrind/numa.h>
+
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <dirent.h>
+#include <sched.h>
+
+std::vector<int> cpuAffinity() {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  KJ_SYSCALL(sched_getaffinity(0, sizeof(set), &set));
+  std::vector<int> cpus;
+  for (int c = 0; c < CPU_SETSIZE; c++) {
+    if (CPU_ISSET(c, &set)) cpus.push_back(c);
+  }
+  return cpus;
+}
+
+namespace {
+
+// "0-3,8,10-11" (the kernel's cpulist format)
+std::vector<int> parseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::istringstream is(list);
+  std::string range;
+  while (std::getline(is, range, ',')) {
+    if (range.empty()) continue;
+    auto dash = range.find('-');
+    int lo = std::atoi(range.c_str());
+    int hi = dash == std::string::npos ? lo : std::atoi(range.c_str() + dash + 1);
+    for (int c = lo; c <= hi; c++) cpus.push_back(c);
+  }
+  return cpus;
+}
+
+}  // namespace
+
+std::vector<NumaNode> numaNodes() {
+  auto allowed = cpuAffinity();
+  std::vector<NumaNode> nodes;
+
+  const char* root = "/sys/devices/system/node";
+  if (DIR* dir = opendir(root)) {
+    while (auto* entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name.compare(0, 4, "node") != 0 ||
+          name.size() == 4 ||
+          !std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+        continue;
+      }
+      std::ifstream is(std::string(root) + "/" + name + "/cpulist");
+      std::string list;
+      std::getline(is, list);
+      NumaNode node;
+      node.id_ = std::atoi(name.c_str() + 4);
+      for (int c : parseCpuList(list)) {
+        if (std::binary_search(allowed.begin(), allowed.end(), c)) node.cpus_.push_back(c);
+      }
+      // Memory-only nodes, or nodes we are not allowed on
+      if (!node.cpus_.empty()) nodes.push_back(std::move(node));
+    }
+    closedir(dir);
+  }
+
+  if (nodes.empty()) {
+    nodes.push_back({0, allowed});
+  }
+  std::sort(nodes.begin(), nodes.end(),
+            [](const NumaNode& a, const NumaNode& b) { return a.id_ < b.id_; });
+  return nodes;
+}
+
+void setCpuAffinity(const std::vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int c : cpus) CPU_SET(c, &set);
+  KJ_SYSCALL(sched_setaffinity(0, sizeof(set), &set), cpus.size());
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// NUMA topology, as far as placing worker processes goes.
+//
+// Read from /sys (no libnuma).  Memory placement relies on the
+// kernel's default first-touch policy: a page lands on the node of
+// the CPU that first writes it, so a process pinned to a node that
+// initializes its own data gets it node-local.
+
+struct NumaNode {
+  uint32_t id_;
+  // The CPUs of the node this process may run on
+  std::vector<int> cpus_;
+};
+
+// Nodes with at least one CPU this process may run on, by id.  A
+// single node with every allowed CPU if the machine (or the sandbox)
+// exposes no topology.
+std::vector<NumaNode> numaNodes();
+
+// The CPUs the calling thread may run on, ascending
+std::vector<int> cpuAffinity();
+
+// Restrict the calling thread (and threads and processes it creates
+// afterwards) to cpus
+void setCpuAffinity(const std::vector<int>& cpus);
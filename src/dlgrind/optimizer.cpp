@@ -0,0 +1,1082 @@
+#include <dlgrind/optimizer.h>
+#include <dlgrind/action_sequence.h>
+#include <dlgrind/mmap.h>
+#include <dlgrind/numa.h>
+#include <dlgrind/rotation.h>
+#include <dlgrind/trace.h>
+
+#include <kj/debug.h>
+#include <kj/exception.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Absolute tolerance when comparing DPS floating point for equality.
+constexpr double EPSILON = 0.01;
+
+// No action pending after a cell's sequence (it is interned as is)
+constexpr action_code_t NO_ACTION = std::numeric_limits<action_code_t>::max();
+
+// Action codes of the automaton are actions or, with macro actions,
+// fragments (see Automaton::macroActions_)
+
+static frames_t edgeFrames(
+    Simulator& sim, const Automaton& automaton, AdventurerState prev, action_code_t code) {
+  frames_t r;
+  auto ok = applyActionCode(sim, automaton.macroActions_, prev, code, &r);
+  KJ_ASSERT(!!ok);
+  return r;
+}
+
+static seq_id_t pushCode(
+    ActionSequenceStore& sequences, const Automaton& automaton, seq_id_t id, action_code_t code) {
+  return automaton.macroActions_
+    ? sequences.push(id, static_cast<ActionFragment>(code))
+    : sequences.push(id, static_cast<Action>(code));
+}
+
+static ActionSequenceStore::Pending pendingWithCode(
+    const ActionSequenceStore& sequences, const Automaton& automaton, seq_id_t id,
+    action_code_t code) {
+  return automaton.macroActions_
+    ? sequences.pending(id, static_cast<ActionFragment>(code))
+    : sequences.pending(id, static_cast<Action>(code));
+}
+
+// Length of an edge in the coarse DP (see OptimizerOptions::tick_).
+// Rounding down keeps the coarse DP optimistic; but an edge must take
+// some time, or a cell would depend on its own frame.
+static frames_t toTicks(frames_t frames, frames_t tick) {
+  return std::max<frames_t>(1, frames / tick);
+}
+
+// Frames (ticks, really) the dense DP ever looks back: every edge is
+// shorter than this
+template <typename StateIndex>
+static frames_t denseFrameWindow(
+    Simulator& sim, const Automaton& automaton, kj::ArrayPtr<const StateIndex> inverse_states,
+    frames_t tick) {
+  auto inverse_actions = automaton.inverse_.getActions();
+  auto inverse_index = automaton.inverse_.getIndex();
+  frames_t max_frames = 1;
+  for (partition_t p = 0; p < automaton.numPartitions_; p++) {
+    for (size_t i = inverse_index[p]; i < inverse_index[p+1]; i++) {
+      auto prev = automaton.partitionReps_[inverse_states[i]];
+      frames_t frames = toTicks(edgeFrames(sim, automaton, prev, inverse_actions[i]), tick);
+      if (frames > max_frames) {
+        max_frames = frames + 1;
+      }
+    }
+  }
+  return max_frames;
+}
+
+// The dense DP's work for one cell: the best way into partition p at
+// frame f over all its incoming edges, on top of what cur, cur_seq and
+// cur_action already hold.  dix(f, p) indexes both best_dps and
+// best_sequence.
+template <typename StateIndex, typename Dix>
+static void relaxDense(
+    Simulator& sim, const Automaton& automaton, kj::ArrayPtr<const StateIndex> inverse_states,
+    frames_t tick, const ActionSequenceStore& sequences, const float* best_dps,
+    const seq_id_t* best_sequence, const Dix& dix, int f, partition_t p,
+    float& cur, seq_id_t& cur_seq, action_code_t& cur_action) {
+  const auto& partition_reps = automaton.partitionReps_;
+  auto inverse_actions = automaton.inverse_.getActions();
+  auto inverse_index = automaton.inverse_.getIndex();
+
+  // Consider all states which could have lead here
+  for (int j = inverse_index[p]; j < inverse_index[p+1]; j++) {
+    partition_t prev_p = inverse_states[j];
+    AdventurerState prev = partition_reps[prev_p];
+    action_code_t a = inverse_actions[j];
+
+    frames_t frames;
+    double dmg;
+    auto r = applyActionCode(sim, automaton.macroActions_, prev, a, &frames, &dmg);
+    KJ_ASSERT(!!r);
+    frames = toTicks(frames, tick);
+
+    if (f >= frames) {
+      auto z = dix(f - frames, prev_p);
+      if (best_dps[z] >= 0) {
+        auto tmp = best_dps[z] + dmg;
+        if (tmp >= 0 && tmp > cur + EPSILON) {
+          cur = tmp;
+          cur_seq = best_sequence[z];
+          cur_action = inverse_actions[j];
+        } else if (tmp >= 0 && tmp > cur - EPSILON) {
+          auto tmp_frags = pendingWithCode(sequences, automaton, best_sequence[z], a);
+          auto cur_frags = cur_action == NO_ACTION
+            ? sequences.pending(cur_seq)
+            : pendingWithCode(sequences, automaton, cur_seq, cur_action);
+          // The idea here is that there are often moves which
+          // have transpositions (end up with the same dps and
+          // end state); let's define an ordering on our move
+          // set and prefer moves that frontload combos to make
+          // the chosen combos deterministic.  This helps in
+          // testing.
+          if (sequences.less(cur_frags, tmp_frags)) {
+            cur = tmp;
+            cur_seq = best_sequence[z];
+            cur_action = inverse_actions[j];
+          }
+        }
+      }
+    }
+  }
+}
+
+// The engines count time in ticks, and report improvements in ticks.
+// The dense engine is instantiated for each width of predecessor id
+// the inverse may be stored in (see PackedInverse::compress).
+template <typename StateIndex>
+static void optimizeDense(
+    Simulator& sim, const Automaton& automaton, kj::ArrayPtr<const StateIndex> inverse_states,
+    frames_t horizon, frames_t tick, PerfReport& perf_report,
+    const std::function<void(const Improvement&)>& on_improvement) {
+  const uint32_t numPartitions = automaton.numPartitions_;
+  const partition_t initialPartition = automaton.initialPartition_;
+
+  // Compute necessary frame window
+  frames_t max_frames;
+  {
+    auto perf = perf_report.phase("frame-window");
+    TraceSpan trace("frame-window");
+    max_frames = denseFrameWindow(sim, automaton, inverse_states, tick);
+  }
+
+  int buffer_size = max_frames * numPartitions;
+  std::vector<float> best_dps(buffer_size, -1);
+  // Sequences are interned after each frame (the store is not thread
+  // safe); until then the best way into each partition is kept as
+  // the sequence of the predecessor plus an action
+  ActionSequenceStore sequences;
+  std::vector<seq_id_t> best_sequence(buffer_size, ActionSequenceStore::EMPTY);
+  std::vector<seq_id_t> pending_seq(numPartitions);
+  std::vector<action_code_t> pending_action(numPartitions);
+  size_t compacted_size = 0;
+
+  auto dix = [&](int frame, int state_ix) {
+    return (frame % max_frames) * numPartitions + state_ix;
+  };
+
+  best_dps[dix(0, initialPartition)] = 0;
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  auto last_print_time = start_time;
+
+  #pragma omp parallel
+  perf_report.beginThread();
+
+  float last_best = 0;
+  // This is the bottleneck!
+  //  - Snapshotting (so I can continue computing later)
+  //  - More state reduction?
+  //    - Unsound approximations; e.g., quantize buff / SP time
+  //  - Branch bound (we KNOW that this is provably worse,
+  //    prune it)
+  //    - Same combo, same buff, dps is less, SP is less
+  //    - Best case "catch up" for states
+  //    - Problem: How to know you've been dominated?  Not so easy
+  //      to tell without more scanning.
+  //  - [TODO] Improve locality of access?
+  //    - Only five actions: bucket them together
+  //    - Lay out action_inverses contiguously, so we don't
+  //      thrash cache
+  //  - Parallelize/Vectorize...
+  //    - ...computation of all incoming actions (no
+  //      data dependency, reduction at the end)
+  //    - ...computation of all states at the same
+  //      frame (no data dependency, reduction at the end)
+  //    - ...all frames within the minimum frame window
+  //      (provably no data dependency.)
+  //  - Small optimizations
+  //    - Compute best as we go (in the main loop), rather
+  //      than another single loop at the end
+  for (int f = 1; f < horizon; f++) {
+    auto cur_time = std::chrono::high_resolution_clock::now();
+    if (cur_time > last_print_time + 1 * std::chrono::seconds(60)) {
+      std::cerr << "fpm: " << (f * std::chrono::minutes(1)) / (cur_time - start_time) << "\n";
+      last_print_time = cur_time;
+    }
+    #pragma omp parallel
+    {
+      // NB: nowait, so the span ends before the implicit barrier
+      // and idle time shows up as a gap in the trace
+      TraceSpan trace("dp-chunk", f);
+      #pragma omp for nowait
+      for (int p = 0; p < numPartitions; p++) {
+        auto& cur_seq = pending_seq[p];
+        auto& cur_action = pending_action[p];
+        cur_seq = best_sequence[dix(f, p)];
+        cur_action = NO_ACTION;
+        relaxDense(sim, automaton, inverse_states, tick, sequences,
+                   best_dps.data(), best_sequence.data(), dix, f, p,
+                   best_dps[dix(f, p)], cur_seq, cur_action);
+      }
+    }
+    {
+      TraceSpan trace("dp-intern", f);
+      for (int p = 0; p < numPartitions; p++) {
+        if (pending_action[p] == NO_ACTION) continue;
+        best_sequence[dix(f, p)] = pushCode(
+            sequences, automaton, pending_seq[p], pending_action[p]);
+      }
+      // Everything in the ring buffer may still be extended, and
+      // nothing else can be
+      if (sequences.size() > std::max<size_t>(2 * compacted_size, 1 << 20)) {
+        TraceSpan trace("dp-compact", f);
+        sequences.compact(kj::arrayPtr(best_sequence.data(), best_sequence.size()));
+        compacted_size = sequences.size();
+      }
+    }
+    TraceSpan trace("dp-best", f);
+    float best = -1;
+    int best_index = -1;
+    int density = 0;
+    for (int p = 0; p < numPartitions; p++) {
+      auto tmp = best_dps[dix(f, p)];
+      if (tmp > best + EPSILON) {
+        best = tmp;
+        best_index = dix(f, p);
+      }
+      if (tmp > 0) {
+        density++;
+      }
+    }
+    if (best >= 0) {
+      if (best >= 0 && best > last_best + EPSILON) {
+        std::ostringstream rotation;
+        sequences.print(rotation, best_sequence[best_index]);
+        on_improvement({rotation.str(), best, static_cast<frames_t>(f)});
+        last_best = best;
+      }
+    }
+  }
+
+  #pragma omp parallel
+  perf_report.endThread("dp");
+
+  auto cur_time = std::chrono::high_resolution_clock::now();
+  std::cerr << "fpm: " << (horizon * std::chrono::minutes(1)) / (cur_time - start_time) << "\n";
+}
+
+namespace {
+
+// Spins until count threads have called wait().  The threads may be
+// in different processes if the barrier lives in shared memory (the
+// atomics are lock free, so they work at any address).  Throws if
+// *failed is set while waiting, so one shard dying does not leave
+// the rest spinning forever.
+class SpinBarrier {
+public:
+  SpinBarrier(uint32_t count, const std::atomic<uint32_t>* failed)
+      : count_(count), failed_(failed) {}
+  KJ_DISALLOW_COPY(SpinBarrier);
+
+  void wait() {
+    uint32_t generation = generation_.load(std::memory_order_acquire);
+    if (arrived_.fetch_add(1, std::memory_order_acq_rel) + 1 == count_) {
+      arrived_.store(0, std::memory_order_relaxed);
+      generation_.store(generation + 1, std::memory_order_release);
+      return;
+    }
+    for (uint32_t spins = 0; generation_.load(std::memory_order_acquire) == generation; spins++) {
+      KJ_REQUIRE(failed_->load(std::memory_order_relaxed) == 0, "another shard failed");
+      if (spins >= 1024) sched_yield();
+    }
+  }
+
+private:
+  static_assert(std::atomic<uint32_t>::is_always_lock_free);
+  const uint32_t count_;
+  const std::atomic<uint32_t>* failed_;
+  std::atomic<uint32_t> arrived_ = 0;
+  std::atomic<uint32_t> generation_ = 0;
+};
+
+// Start of the memory the shards share
+struct ShardedShared {
+  explicit ShardedShared(uint32_t num_threads) : barrier_(num_threads, &failed_) {}
+  std::atomic<uint32_t> failed_ = 0;
+  // Every thread of every shard
+  SpinBarrier barrier_;
+};
+
+}  // namespace
+
+// The dense DP, with the partitions split over worker processes (see
+// OptimizerEngine::SHARDED).
+//
+// best_dps lives in shared memory.  Each shard's partitions are a
+// contiguous block of columns, padded to whole pages, which the shard
+// initializes itself after pinning to its node, so its part of every
+// row is node local.  A frame is: every thread computes its cells,
+// then all threads of all shards meet at a barrier in shared memory.
+//
+// Sequences are not shared.  Every shard keeps its own identical copy
+// of the store and of best_sequence: after each frame, each interns
+// all the pending sequences (which are shared), in the same order, so
+// every copy hands out the same ids.  Interning is serial in the dense
+// engine anyway.
+template <typename StateIndex>
+static void optimizeSharded(
+    Simulator& sim, const Automaton& automaton, kj::ArrayPtr<const StateIndex> inverse_states,
+    frames_t horizon, frames_t tick, size_t num_shards, PerfReport& perf_report,
+    const std::function<void(const Improvement&)>& on_improvement) {
+  const uint32_t numPartitions = automaton.numPartitions_;
+  const partition_t initialPartition = automaton.initialPartition_;
+  auto inverse_index = automaton.inverse_.getIndex();
+
+  frames_t max_frames;
+  {
+    auto perf = perf_report.phase("frame-window");
+    TraceSpan trace("frame-window");
+    // At least two rows: shard 0 reads frame f back while the others
+    // may already be writing f + 1
+    max_frames = std::max<frames_t>(2, denseFrameWindow(sim, automaton, inverse_states, tick));
+  }
+
+  // Shard s runs on node s % nodes.size(), splitting its CPUs with the
+  // other shards there
+  auto nodes = numaNodes();
+  if (num_shards == 0) num_shards = nodes.size();
+  num_shards = std::max<size_t>(1, std::min<size_t>(num_shards, numPartitions));
+  std::vector<size_t> first_thread(num_shards + 1, 0);
+  for (size_t s = 0; s < num_shards; s++) {
+    const auto& node = nodes[s % nodes.size()];
+    size_t sharing = num_shards / nodes.size() + (s % nodes.size() < num_shards % nodes.size());
+    first_thread[s + 1] = first_thread[s] + std::max<size_t>(1, node.cpus_.size() / sharing);
+  }
+  const size_t num_threads = first_thread[num_shards];
+
+  // Thread k computes partitions [thread_begin[k], thread_begin[k+1]),
+  // split so each thread pulls along about as many edges
+  std::vector<partition_t> thread_begin(num_threads + 1, numPartitions);
+  {
+    partition_t p = 0;
+    uint64_t num_edges = inverse_index[numPartitions];
+    for (size_t k = 0; k < num_threads; k++) {
+      while (p < numPartitions && inverse_index[p] < num_edges * k / num_threads) p++;
+      thread_begin[k] = p;
+    }
+  }
+
+  // Column of each partition in a row of best_dps
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  auto round_up = [](size_t n, size_t m) { return (n + m - 1) / m * m; };
+  std::vector<uint32_t> column(numPartitions);
+  size_t stride = 0;
+  for (size_t s = 0; s < num_shards; s++) {
+    partition_t lo = thread_begin[first_thread[s]];
+    partition_t hi = thread_begin[first_thread[s + 1]];
+    for (partition_t p = lo; p < hi; p++) column[p] = stride + (p - lo);
+    stride = round_up(stride + (hi - lo), page_size / sizeof(float));
+  }
+  auto dix = [&](int frame, partition_t p) {
+    return (frame % max_frames) * stride + column[p];
+  };
+
+  // Pending sequences are double buffered by frame: a shard may start
+  // on frame f + 1 while others are still interning frame f
+  const size_t pending_seq_offset = align8(sizeof(ShardedShared));
+  const size_t pending_action_offset =
+      align8(pending_seq_offset + 2 * numPartitions * sizeof(seq_id_t));
+  const size_t best_dps_offset =
+      round_up(pending_action_offset + 2 * numPartitions * sizeof(action_code_t), page_size);
+  auto mapping = mmapShared(
+      best_dps_offset + static_cast<size_t>(max_frames) * stride * sizeof(float));
+  auto* shared = new (mapping.begin()) ShardedShared(num_threads);
+  auto* pending_seqs = reinterpret_cast<seq_id_t*>(mapping.begin() + pending_seq_offset);
+  auto* pending_actions = reinterpret_cast<action_code_t*>(mapping.begin() + pending_action_offset);
+  auto* best_dps = reinterpret_cast<float*>(mapping.begin() + best_dps_offset);
+
+  auto run_shard = [&](size_t s) {
+    setCpuAffinity(nodes[s % nodes.size()].cpus_);
+    partition_t lo = thread_begin[first_thread[s]];
+    partition_t hi = thread_begin[first_thread[s + 1]];
+    // First touch, from the node
+    for (frames_t f = 0; f < max_frames; f++) {
+      for (partition_t p = lo; p < hi; p++) best_dps[dix(f, p)] = -1;
+    }
+    if (initialPartition >= lo && initialPartition < hi) best_dps[dix(0, initialPartition)] = 0;
+
+    ActionSequenceStore sequences;
+    std::vector<seq_id_t> best_sequence(max_frames * stride, ActionSequenceStore::EMPTY);
+    size_t compacted_size = 0;
+    SpinBarrier shard_barrier(first_thread[s + 1] - first_thread[s], &shared->failed_);
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    auto last_print_time = start_time;
+    float last_best = 0;
+
+    auto run_thread = [&](size_t k) {
+      shared->barrier_.wait();
+      for (int f = 1; f < horizon; f++) {
+        auto* pending_seq = pending_seqs + (f % 2) * numPartitions;
+        auto* pending_action = pending_actions + (f % 2) * numPartitions;
+        {
+          TraceSpan trace("dp-chunk", f);
+          for (partition_t p = thread_begin[k]; p < thread_begin[k + 1]; p++) {
+            pending_seq[p] = best_sequence[dix(f, p)];
+            pending_action[p] = NO_ACTION;
+            relaxDense(sim, automaton, inverse_states, tick, sequences,
+                       best_dps, best_sequence.data(), dix, f, p,
+                       best_dps[dix(f, p)], pending_seq[p], pending_action[p]);
+          }
+        }
+        shared->barrier_.wait();
+        if (k == first_thread[s]) {
+          TraceSpan trace("dp-intern", f);
+          for (partition_t p = 0; p < numPartitions; p++) {
+            if (pending_action[p] == NO_ACTION) continue;
+            best_sequence[dix(f, p)] = pushCode(
+                sequences, automaton, pending_seq[p], pending_action[p]);
+          }
+          if (sequences.size() > std::max<size_t>(2 * compacted_size, 1 << 20)) {
+            TraceSpan trace("dp-compact", f);
+            sequences.compact(kj::arrayPtr(best_sequence.data(), best_sequence.size()));
+            compacted_size = sequences.size();
+          }
+        }
+        if (k == 0) {
+          // Shard 0 is this process, so it reports
+          TraceSpan trace("dp-best", f);
+          auto cur_time = std::chrono::high_resolution_clock::now();
+          if (cur_time > last_print_time + 1 * std::chrono::seconds(60)) {
+            std::cerr << "fpm: " << (f * std::chrono::minutes(1)) / (cur_time - start_time) << "\n";
+            last_print_time = cur_time;
+          }
+          float best = -1;
+          int64_t best_index = -1;
+          for (partition_t p = 0; p < numPartitions; p++) {
+            auto tmp = best_dps[dix(f, p)];
+            if (tmp > best + EPSILON) {
+              best = tmp;
+              best_index = dix(f, p);
+            }
+          }
+          if (best >= 0 && best > last_best + EPSILON) {
+            std::ostringstream rotation;
+            sequences.print(rotation, best_sequence[best_index]);
+            on_improvement({rotation.str(), best, static_cast<frames_t>(f)});
+            last_best = best;
+          }
+        }
+        shard_barrier.wait();
+      }
+    };
+
+    // The first thread is the calling one, so improvements are
+    // reported from the thread that asked for them
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto guarded = [&](size_t k) {
+      try {
+        run_thread(k);
+      } catch (...) {
+        shared->failed_.store(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) error = std::current_exception();
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t k = first_thread[s] + 1; k < first_thread[s + 1]; k++) {
+      threads.emplace_back(guarded, k);
+    }
+    guarded(first_thread[s]);
+    for (auto& t : threads) t.join();
+    if (error) std::rethrow_exception(error);
+  };
+
+  // Anything buffered would be written once per process
+  std::cout.flush();
+  std::cerr.flush();
+
+  // The workers are forked, not exec'd, and never touch OpenMP (whose
+  // runtime does not survive a fork); the threads within a shard are
+  // plain threads
+  std::vector<pid_t> children;
+  for (size_t s = 1; s < num_shards; s++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      // Let the shards already started give up
+      shared->failed_.store(1, std::memory_order_relaxed);
+      KJ_FAIL_SYSCALL("fork", errno, s);
+    }
+    if (pid == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      int status = 0;
+      try {
+        run_shard(s);
+      } catch (...) {
+        shared->failed_.store(1, std::memory_order_relaxed);
+        KJ_LOG(ERROR, s, kj::getCaughtExceptionAsKj(), "shard failed");
+        status = 1;
+      }
+      _exit(status);
+    }
+    children.push_back(pid);
+  }
+  KJ_LOG(INFO, num_shards, num_threads, nodes.size(), "started shards");
+
+  // Shards that die without unwinding (e.g., on a signal) only show up
+  // here
+  std::thread reaper([&]() {
+    for (pid_t pid : children) {
+      int status;
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        shared->failed_.store(1, std::memory_order_relaxed);
+      }
+    }
+  });
+
+  auto affinity = cpuAffinity();
+  std::exception_ptr error;
+  {
+    auto perf = perf_report.phase("dp");
+    try {
+      run_shard(0);
+    } catch (...) {
+      shared->failed_.store(1, std::memory_order_relaxed);
+      error = std::current_exception();
+    }
+  }
+  setCpuAffinity(affinity);
+  reaper.join();
+  if (error) std::rethrow_exception(error);
+  KJ_REQUIRE(shared->failed_.load() == 0, "a shard failed");
+}
+
+EdgeTable buildEdgeTable(Simulator& sim, const Automaton& automaton, frames_t tick) {
+  const uint32_t numPartitions = automaton.numPartitions_;
+  auto inverse_actions = automaton.inverse_.getActions();
+  auto inverse_index = automaton.inverse_.getIndex();
+  size_t num_edges = automaton.inverse_.size();
+
+  EdgeTable t;
+  t.frames_.resize(num_edges);
+  t.dmg_.resize(num_edges);
+  t.source_.resize(num_edges);
+  t.target_.resize(num_edges);
+  t.forwardIndex_.assign(numPartitions + 1, 0);
+  t.forwardEdges_.resize(num_edges);
+
+  for (partition_t p = 0; p < numPartitions; p++) {
+    for (size_t j = inverse_index[p]; j < inverse_index[p+1]; j++) {
+      t.source_[j] = automaton.inverse_.getState(j);
+      auto prev = automaton.partitionReps_[t.source_[j]];
+      auto r = applyActionCode(
+          sim, automaton.macroActions_, prev, inverse_actions[j], &t.frames_[j], &t.dmg_[j]);
+      KJ_ASSERT(!!r);
+      // Otherwise a cell would depend on its own frame
+      KJ_REQUIRE(t.frames_[j] > 0, p, j);
+      t.frames_[j] = toTicks(t.frames_[j], tick);
+      t.target_[j] = p;
+      t.maxFrames_ = std::max(t.maxFrames_, t.frames_[j]);
+      t.forwardIndex_[t.source_[j] + 1]++;
+    }
+  }
+  for (partition_t p = 0; p < numPartitions; p++) {
+    t.forwardIndex_[p+1] += t.forwardIndex_[p];
+  }
+  std::vector<uint32_t> fill(t.forwardIndex_.begin(), t.forwardIndex_.end() - 1);
+  for (uint32_t j = 0; j < num_edges; j++) {
+    t.forwardEdges_[fill[t.source_[j]]++] = j;
+  }
+  return t;
+}
+
+
+// Event driven version of optimizeDense.  A cell (f, p) is only
+// looked at if some reachable cell has an edge into it: when a cell is
+// settled, each of its outgoing edges files an event at the frame the
+// edge lands on.  Settling a frame is then sorting its events and
+// folding them per partition, in inverse order, the same way the
+// dense loop does.
+//
+// Unlike the dense loop, a cell holds the best damage in exactly f
+// frames (the dense ring buffer also carries over the cell from a
+// window ago).  That never changes what is reported: whatever the
+// carried over value leads to was already reached a window earlier.
+static void optimizeSparse(
+    Simulator& sim, const Automaton& automaton, frames_t horizon, frames_t tick,
+    PerfReport& perf_report,
+    const std::function<void(const Improvement&)>& on_improvement) {
+  const uint32_t numPartitions = automaton.numPartitions_;
+  auto inverse_actions = automaton.inverse_.getActions();
+
+  EdgeTable edges;
+  {
+    auto perf = perf_report.phase("edge-table");
+    TraceSpan trace("edge-table");
+    edges = buildEdgeTable(sim, automaton, tick);
+  }
+  const frames_t window = edges.maxFrames_ + 1;
+
+  struct Event {
+    partition_t target_;
+    uint32_t edge_;
+    bool operator<(const Event& o) const {
+      return target_ != o.target_ ? target_ < o.target_ : edge_ < o.edge_;
+    }
+  };
+  // Indexed by frame % window
+  std::vector<std::vector<Event>> events(window);
+
+  size_t buffer_size = static_cast<size_t>(window) * numPartitions;
+  std::vector<float> best_dps(buffer_size, -1);
+  ActionSequenceStore sequences;
+  std::vector<seq_id_t> best_sequence(buffer_size, ActionSequenceStore::EMPTY);
+  size_t compacted_size = 0;
+
+  auto dix = [&](frames_t frame, partition_t p) {
+    return static_cast<size_t>(frame % window) * numPartitions + p;
+  };
+
+  // Cells settled in the current frame, and how they were reached
+  struct Settled {
+    partition_t p_;
+    float dmg_;
+    seq_id_t seq_;
+    action_code_t action_;
+  };
+  std::vector<Settled> settled;
+  std::vector<size_t> group_begin;
+
+  auto push = [&](frames_t f, partition_t p) {
+    for (uint32_t i = edges.forwardIndex_[p]; i < edges.forwardIndex_[p+1]; i++) {
+      uint32_t j = edges.forwardEdges_[i];
+      frames_t g = f + edges.frames_[j];
+      if (g < horizon) {
+        events[g % window].push_back({edges.target_[j], j});
+      }
+    }
+  };
+
+  best_dps[dix(0, automaton.initialPartition_)] = 0;
+  push(0, automaton.initialPartition_);
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  auto last_print_time = start_time;
+
+  #pragma omp parallel
+  perf_report.beginThread();
+
+  float last_best = 0;
+  size_t num_events = 0;
+  size_t num_settled = 0;
+  for (frames_t f = 1; f < horizon; f++) {
+    auto cur_time = std::chrono::high_resolution_clock::now();
+    if (cur_time > last_print_time + 1 * std::chrono::seconds(60)) {
+      std::cerr << "fpm: " << (f * std::chrono::minutes(1)) / (cur_time - start_time) << "\n";
+      last_print_time = cur_time;
+    }
+    auto& pending = events[f % window];
+    num_events += pending.size();
+    {
+      TraceSpan trace("sparse-sort", f);
+      std::sort(pending.begin(), pending.end());
+    }
+    group_begin.clear();
+    for (size_t i = 0; i < pending.size(); i++) {
+      if (i == 0 || pending[i].target_ != pending[i-1].target_) group_begin.push_back(i);
+    }
+    size_t num_groups = group_begin.size();
+    group_begin.push_back(pending.size());
+    settled.resize(num_groups);
+    num_settled += num_groups;
+
+    #pragma omp parallel
+    {
+      TraceSpan trace("sparse-chunk", f);
+      #pragma omp for nowait schedule(dynamic, 64)
+      for (size_t g = 0; g < num_groups; g++) {
+        float cur = -1;
+        seq_id_t cur_seq = ActionSequenceStore::EMPTY;
+        action_code_t cur_action = 0;
+        for (size_t i = group_begin[g]; i < group_begin[g+1]; i++) {
+          uint32_t j = pending[i].edge_;
+          auto z = dix(f - edges.frames_[j], edges.source_[j]);
+          auto tmp = best_dps[z] + edges.dmg_[j];
+          if (tmp > cur + EPSILON) {
+            cur = tmp;
+            cur_seq = best_sequence[z];
+            cur_action = inverse_actions[j];
+          } else if (tmp > cur - EPSILON) {
+            // Same tie break as the dense loop
+            auto tmp_frags = pendingWithCode(sequences, automaton, best_sequence[z], inverse_actions[j]);
+            auto cur_frags = pendingWithCode(sequences, automaton, cur_seq, cur_action);
+            if (sequences.less(cur_frags, tmp_frags)) {
+              cur = tmp;
+              cur_seq = best_sequence[z];
+              cur_action = inverse_actions[j];
+            }
+          }
+        }
+        settled[g] = {pending[group_begin[g]].target_, cur, cur_seq, cur_action};
+      }
+    }
+    pending.clear();
+
+    TraceSpan trace("sparse-settle", f);
+    float best = -1;
+    seq_id_t best_seq = ActionSequenceStore::EMPTY;
+    for (const auto& c : settled) {
+      best_dps[dix(f, c.p_)] = c.dmg_;
+      auto seq = pushCode(sequences, automaton, c.seq_, c.action_);
+      best_sequence[dix(f, c.p_)] = seq;
+      if (c.dmg_ > best + EPSILON) {
+        best = c.dmg_;
+        best_seq = seq;
+      }
+      push(f, c.p_);
+    }
+    if (best >= 0 && best > last_best + EPSILON) {
+      std::ostringstream rotation;
+      sequences.print(rotation, best_seq);
+      on_improvement({rotation.str(), best, f});
+      last_best = best;
+    }
+    if (sequences.size() > std::max<size_t>(2 * compacted_size, 1 << 20)) {
+      TraceSpan trace("dp-compact", f);
+      sequences.compact(kj::arrayPtr(best_sequence.data(), best_sequence.size()));
+      compacted_size = sequences.size();
+    }
+  }
+
+  #pragma omp parallel
+  perf_report.endThread("dp");
+
+  KJ_LOG(INFO, num_events, num_settled, static_cast<uint64_t>(horizon) * numPartitions,
+         "sparse dp cells touched");
+
+  auto cur_time = std::chrono::high_resolution_clock::now();
+  std::cerr << "fpm: " << (horizon * std::chrono::minutes(1)) / (cur_time - start_time) << "\n";
+}
+
+std::optional<OptimizerEngine> parseOptimizerEngine(kj::StringPtr name) {
+  if (name == "dense") return OptimizerEngine::DENSE;
+  if (name == "sparse") return OptimizerEngine::SPARSE;
+  if (name == "forward") return OptimizerEngine::FORWARD;
+  if (name == "beam") return OptimizerEngine::BEAM;
+  if (name == "sharded") return OptimizerEngine::SHARDED;
+  return std::nullopt;
+}
+
+// The exact frames and damage of a rotation the coarse DP found
+static Improvement resimulate(
+    Simulator& sim, const Automaton& automaton, const Improvement& coarse, frames_t tick) {
+  auto actions = parseRotation(coarse.rotation_.c_str());
+  KJ_ASSERT(!!actions, coarse.rotation_.c_str());
+  AdventurerState st = automaton.partitionReps_[automaton.initialPartition_];
+  Improvement r;
+  r.rotation_ = coarse.rotation_;
+  double dmg = 0;
+  r.frames_ = 0;
+  for (auto a : *actions) {
+    frames_t frames;
+    double hit_dmg;
+    auto next = sim.applyAction(st, a, &frames, &hit_dmg);
+    KJ_ASSERT(!!next, coarse.rotation_.c_str());
+    st = *next;
+    r.frames_ += frames;
+    dmg += hit_dmg;
+  }
+  r.dmg_ = dmg;
+  r.boundDmg_ = coarse.dmg_;
+  r.boundFrames_ = (coarse.frames_ + 1) * tick;
+  return r;
+}
+
+void optimizeRotation(
+    Simulator& sim, const Automaton& automaton, frames_t horizon, PerfReport& perf,
+    const std::function<void(const Improvement&)>& on_improvement,
+    const OptimizerOptions& options) {
+  const frames_t tick = options.tick_;
+  KJ_REQUIRE(tick >= 1, tick);
+
+  auto run = [&](frames_t horizon_ticks, const std::function<void(const Improvement&)>& cb) {
+    switch (options.engine_) {
+      case OptimizerEngine::DENSE:
+        automaton.inverse_.visitStates([&](auto inverse_states) {
+          optimizeDense(sim, automaton, inverse_states, horizon_ticks, tick, perf, cb);
+        });
+        break;
+      case OptimizerEngine::SPARSE:
+        optimizeSparse(sim, automaton, horizon_ticks, tick, perf, cb);
+        break;
+      case OptimizerEngine::SHARDED:
+        automaton.inverse_.visitStates([&](auto inverse_states) {
+          optimizeSharded(sim, automaton, inverse_states, horizon_ticks, tick,
+                          options.shards_, perf, cb);
+        });
+        break;
+      case OptimizerEngine::FORWARD:
+      case OptimizerEngine::BEAM:
+        KJ_FAIL_REQUIRE("the forward engines run without an automaton");
+    }
+  };
+
+  if (tick == 1) {
+    run(horizon, on_improvement);
+    return;
+  }
+
+  // Rounding edges down makes every rotation at most as long in ticks
+  // as it is in frames / tick, so the coarse DP's best by tick t bounds
+  // the exact optimum below (t + 1) * tick frames.  That needs every
+  // edge to be at least a tick: a shorter one would be rounded up, and
+  // the DP could miss rotations that fit.
+  frames_t min_frames = std::numeric_limits<frames_t>::max();
+  {
+    auto inverse_actions = automaton.inverse_.getActions();
+    for (size_t j = 0; j < automaton.inverse_.size(); j++) {
+      min_frames = std::min(min_frames, edgeFrames(
+          sim, automaton, automaton.partitionReps_[automaton.inverse_.getState(j)],
+          inverse_actions[j]));
+    }
+  }
+  KJ_REQUIRE(min_frames >= tick, tick, min_frames, "tick is longer than the shortest action");
+
+  // Rotations in fewer than horizon frames are at most (horizon - 1) /
+  // tick ticks long
+  run((horizon - 1) / tick + 1, [&](const Improvement& coarse) {
+    on_improvement(resimulate(sim, automaton, coarse, tick));
+  });
+}
+
+void optimizeRotationForward(
+    Simulator& sim, AdventurerState init, frames_t horizon, PerfReport& perf_report,
+    const std::function<void(const Improvement&)>& on_improvement,
+    const OptimizerOptions& options) {
+  KJ_REQUIRE(options.tick_ == 1, "the forward engine does not support ticks");
+  const auto& layout = sim.layout();
+  const size_t beam_width = options.engine_ == OptimizerEngine::BEAM ? options.beamWidth_ : 0;
+  KJ_REQUIRE(options.engine_ == OptimizerEngine::FORWARD || beam_width > 0);
+
+  // Beam score, on top of the damage so far: SP banked towards each
+  // skill, valued at that fraction of the skill's damage.  States in
+  // the same frame have the same time left, so this is what tells
+  // their futures apart.
+  std::array<double, 3> skill_dmg = {};
+  const auto& params = sim.params();
+  for (size_t k = 0; k < params.numSkills_; k++) {
+    AdventurerState st = init;
+    st.afterAction_ = AfterAction::AFTER_NOTHING;
+    st.uiHiddenFramesLeft_ = 0;
+    st.sp_[k] = params.skillSp_[k];
+    double d = 0;
+    if (sim.applyAction(st, static_cast<Action>(toIndex(Action::S1) + k), nullptr, &d)) {
+      skill_dmg[k] = d / params.skillSp_[k];
+    }
+  }
+  auto banked_sp_value = [&](const AdventurerState& st) {
+    double v = 0;
+    for (size_t k = 0; k < params.numSkills_; k++) v += st.sp_[k] * skill_dmg[k];
+    return v;
+  };
+
+  // The best way found so far into a state at some frame.  As in the
+  // dense loop, the sequence is interned only when the frame settles.
+  struct Cell {
+    float dmg_ = -1;
+    seq_id_t seq_ = ActionSequenceStore::EMPTY;
+    action_code_t action_ = NO_ACTION;
+  };
+  // Indexed by frame; a frame's table is freed once it is expanded
+  std::vector<PackedStateMap<Cell>> cells(horizon);
+  ActionSequenceStore sequences;
+  size_t compacted_size = 0;
+
+  cells[0][layout.pack(init)] = {0, ActionSequenceStore::EMPTY, NO_ACTION};
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+  auto last_print_time = start_time;
+
+  #pragma omp parallel
+  perf_report.beginThread();
+
+  float last_best = 0;
+  size_t num_expanded = 0;
+  size_t num_pruned = 0;
+  std::vector<std::pair<PackedState, Cell>> entries;
+  std::vector<size_t> kept;
+  std::vector<float> scores;
+  std::vector<float> dmgs;
+  std::vector<seq_id_t> seqs;
+  AdventurerStateBatch batch;
+  // What each action does to each expanded state
+  struct Expansion {
+    std::vector<PackedState> packed_;
+    std::vector<frames_t> frames_;
+    std::vector<double> dmg_;
+    std::vector<uint8_t> valid_;
+  };
+  std::array<Expansion, NUM_ACTIONS> expanded;
+  for (frames_t f = 0; f < horizon; f++) {
+    auto cur_time = std::chrono::high_resolution_clock::now();
+    if (cur_time > last_print_time + 1 * std::chrono::seconds(60)) {
+      std::cerr << "fpm: " << (f * std::chrono::minutes(1)) / (cur_time - start_time) << "\n";
+      last_print_time = cur_time;
+    }
+
+    // Settle this frame
+    if (cells[f].empty()) continue;
+    float best = -1;
+    seq_id_t best_seq = ActionSequenceStore::EMPTY;
+    size_t n;
+    {
+      TraceSpan trace("forward-settle", f);
+      entries.assign(cells[f].begin(), cells[f].end());
+      PackedStateMap<Cell>().swap(cells[f]);
+      auto intern = [&](const Cell& c) {
+        return c.action_ == NO_ACTION ? c.seq_ : sequences.push(c.seq_, static_cast<Action>(c.action_));
+      };
+      const Cell* best_cell = nullptr;
+      for (const auto& kv : entries) {
+        if (kv.second.dmg_ > best + EPSILON) {
+          best = kv.second.dmg_;
+          best_cell = &kv.second;
+        }
+      }
+      best_seq = intern(*best_cell);
+
+      // Beam: only expand the most promising states (but the best
+      // rotation of the frame is reported regardless)
+      kept.resize(entries.size());
+      for (size_t i = 0; i < entries.size(); i++) kept[i] = i;
+      if (beam_width && entries.size() > beam_width) {
+        scores.resize(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) {
+          scores[i] = entries[i].second.dmg_ + banked_sp_value(layout.unpack(entries[i].first));
+        }
+        std::nth_element(kept.begin(), kept.begin() + beam_width, kept.end(), [&](size_t x, size_t y) {
+          return scores[x] > scores[y];
+        });
+        kept.resize(beam_width);
+        std::sort(kept.begin(), kept.end());
+        num_pruned += entries.size() - beam_width;
+      }
+
+      n = kept.size();
+      num_expanded += n;
+      batch.resize(n);
+      dmgs.resize(n);
+      seqs.resize(n);
+      for (size_t i = 0; i < n; i++) {
+        const auto& kv = entries[kept[i]];
+        batch.set(i, layout.unpack(kv.first));
+        dmgs[i] = kv.second.dmg_;
+        seqs[i] = &kv.second == best_cell ? best_seq : intern(kv.second);
+      }
+    }
+    if (best >= 0 && best > last_best + EPSILON) {
+      std::ostringstream rotation;
+      sequences.print(rotation, best_seq);
+      on_improvement({rotation.str(), best, f});
+      last_best = best;
+    }
+
+    // Everything still pending may be extended, and nothing else can be
+    if (sequences.size() > std::max<size_t>(2 * compacted_size, 1 << 20)) {
+      TraceSpan trace("dp-compact", f);
+      std::vector<seq_id_t> ids(seqs);
+      for (frames_t g = f + 1; g < horizon; g++) {
+        for (const auto& kv : cells[g]) ids.push_back(kv.second.seq_);
+      }
+      sequences.compact(kj::arrayPtr(ids.data(), ids.size()));
+      std::copy(ids.begin(), ids.begin() + n, seqs.begin());
+      size_t i = n;
+      for (frames_t g = f + 1; g < horizon; g++) {
+        for (auto& kv : cells[g]) kv.second.seq_ = ids[i++];
+      }
+      compacted_size = sequences.size();
+    }
+
+    // Expand it: simulate and pack in parallel, a chunk of states for
+    // one action at a time, then merge serially in the same order as
+    // before, so ties break the same way
+    TraceSpan trace("forward-expand", f);
+    constexpr size_t CHUNK = 1024;
+    const size_t num_chunks = (n + CHUNK - 1) / CHUNK;
+    for (auto& e : expanded) {
+      e.packed_.resize(n);
+      e.frames_.resize(n);
+      e.dmg_.resize(n);
+      e.valid_.resize(n);
+    }
+    #pragma omp parallel
+    {
+      AdventurerStateBatch sub;
+      AdventurerStateBatch n_sub;
+      std::vector<frames_t> frames;
+      std::vector<double> dmg;
+      std::vector<uint8_t> valid;
+      #pragma omp for schedule(dynamic)
+      for (size_t t = 0; t < NUM_ACTIONS * num_chunks; t++) {
+        size_t k = t / num_chunks;
+        size_t begin = (t % num_chunks) * CHUNK;
+        size_t end = std::min(begin + CHUNK, n);
+        sub.resize(end - begin);
+        for (size_t i = begin; i < end; i++) sub.set(i - begin, batch.get(i));
+        sim.applyActionBatch(sub, static_cast<Action>(k), &n_sub, &frames, &dmg, &valid);
+        auto& e = expanded[k];
+        for (size_t i = begin; i < end; i++) {
+          e.valid_[i] = valid[i - begin];
+          e.frames_[i] = frames[i - begin];
+          e.dmg_[i] = dmg[i - begin];
+          if (e.valid_[i]) e.packed_[i] = layout.pack(n_sub.get(i - begin));
+        }
+      }
+    }
+    for (size_t k = 0; k < NUM_ACTIONS; k++) {
+      auto a = static_cast<Action>(k);
+      const auto& e = expanded[k];
+      for (size_t i = 0; i < n; i++) {
+        if (!e.valid_[i]) continue;
+        // Otherwise we would be adding to a settled frame
+        KJ_REQUIRE(e.frames_[i] > 0, f, k);
+        frames_t g = f + e.frames_[i];
+        if (g >= horizon) continue;
+        auto& cell = cells[g][e.packed_[i]];
+        auto tmp = dmgs[i] + e.dmg_[i];
+        if (tmp > cell.dmg_ + EPSILON) {
+          cell = {static_cast<float>(tmp), seqs[i], static_cast<action_code_t>(k)};
+        } else if (tmp > cell.dmg_ - EPSILON) {
+          // Same tie break as the dense loop
+          auto tmp_frags = sequences.pending(seqs[i], a);
+          auto cur_frags = sequences.pending(cell.seq_, static_cast<Action>(cell.action_));
+          if (sequences.less(cur_frags, tmp_frags)) {
+            cell = {static_cast<float>(tmp), seqs[i], static_cast<action_code_t>(k)};
+          }
+        }
+      }
+    }
+  }
+
+  #pragma omp parallel
+  perf_report.endThread("dp");
+
+  KJ_LOG(INFO, num_expanded, num_pruned, "forward dp states expanded");
+
+  auto cur_time = std::chrono::high_resolution_clock::now();
+  std::cerr << "fpm: " << (horizon * std::chrono::minutes(1)) / (cur_time - start_time) << "\n";
+}
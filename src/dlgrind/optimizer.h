@@ -0,0 +1,107 @@
+#pragma once
+
+#include <dlgrind/automaton.h>
+#include <dlgrind/perf_counters.h>
+#include <dlgrind/simulator.h>
+
+#include <kj/string.h>
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+// A new best rotation, at the first frame count it is reachable in
+struct Improvement {
+  std::string rotation_;  // e.g., "c5fs s1  c5 "
+  float dmg_;
+  frames_t frames_;
+  // With a tick, dmg_ and frames_ are the rotation re-simulated
+  // exactly, and boundDmg_ is what the coarse DP found by then: no
+  // rotation in fewer than boundFrames_ frames does more
+  float boundDmg_ = 0;
+  frames_t boundFrames_ = 0;
+};
+
+// How to run the DP.  Both find the same damage; they differ only in
+// what they touch.
+enum class OptimizerEngine {
+  // Every partition at every frame, pulling from all incoming edges
+  DENSE,
+  // Only the cells some reachable cell has an edge into, pushed along
+  // a forward CSR; cheap while few cells are reachable (early frames,
+  // sparse configs)
+  SPARSE,
+  // No automaton: expand the states actually reached from the initial
+  // state, frame by frame, with a hash table per frame.  Skips
+  // enumerating and minimizing the whole state space, which is most
+  // of the time spent on short horizons.  See optimizeRotationForward.
+  FORWARD,
+  // Approximate: FORWARD, but only the OptimizerOptions::beamWidth_
+  // most promising states of each frame are expanded.  For state
+  // spaces too large for the exact engines; with a wide enough beam
+  // it is exact.
+  BEAM,
+  // DENSE, split over worker processes that share the DP table, one
+  // per NUMA node by default, each pinned to its node with its part of
+  // the table placed there.  For machines where one OpenMP team
+  // spanning sockets stops scaling.  See OptimizerOptions::shards_.
+  SHARDED,
+};
+
+// Up to this horizon, building the automaton costs more than it saves
+// and FORWARD is the better default
+constexpr frames_t FORWARD_MAX_HORIZON = 1800;
+
+// "dense", "sparse", ...
+std::optional<OptimizerEngine> parseOptimizerEngine(kj::StringPtr name);
+
+// The automaton's edges in both directions, with the length (in
+// ticks, see OptimizerOptions::tick_) and damage of each edge
+// computed once up front.  Edges are numbered as in the inverse, so
+// edge j leads into the partition whose inverse range contains j.
+struct EdgeTable {
+  std::vector<frames_t> frames_;
+  std::vector<double> dmg_;
+  // Partitions each edge leaves and enters (source_ unpacked from the
+  // inverse, whatever width it is stored in)
+  std::vector<partition_t> source_;
+  std::vector<partition_t> target_;
+  // Forward CSR: the edges out of partition p are
+  // forwardEdges_[forwardIndex_[p]..forwardIndex_[p+1]), ascending
+  std::vector<uint32_t> forwardIndex_;
+  std::vector<uint32_t> forwardEdges_;
+  frames_t maxFrames_ = 0;
+};
+
+EdgeTable buildEdgeTable(Simulator& sim, const Automaton& automaton, frames_t tick = 1);
+
+struct OptimizerOptions {
+  OptimizerEngine engine_ = OptimizerEngine::DENSE;
+  // Run the DP in units of this many frames, rounding the length of
+  // every action down (so the DP shrinks by about this factor).  The
+  // rotations it finds are re-simulated exactly, and the gap to the
+  // exact optimum reported.  Only edge lengths are rounded: UI-hidden
+  // and buff timers are part of the automaton's states, so rounding
+  // them would change the automaton itself (see
+  // Simulator::setTimerBucket for that).
+  frames_t tick_ = 1;
+  // States expanded per frame by the BEAM engine
+  size_t beamWidth_ = 1 << 14;
+  // Worker processes of the SHARDED engine (0: one per NUMA node)
+  size_t shards_ = 0;
+};
+
+// The DP: best damage over the automaton for every frame count below
+// horizon.  Calls on_improvement, in frame order, each time the best
+// damage goes up.
+void optimizeRotation(
+    Simulator& sim, const Automaton& automaton, frames_t horizon, PerfReport& perf,
+    const std::function<void(const Improvement&)>& on_improvement,
+    const OptimizerOptions& options = {});
+
+// The same, for the FORWARD and BEAM engines (which need no automaton)
+void optimizeRotationForward(
+    Simulator& sim, AdventurerState init, frames_t horizon, PerfReport& perf,
+    const std::function<void(const Improvement&)>& on_improvement,
+    const OptimizerOptions& options = {});
@@ -0,0 +1,222 @@
+#include <dlgrind/perf_counters.h>
+
+#include <kj/debug.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <map>
+
+#include <linux/perf_event.h>
+#include <omp.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char* perfEventName(size_t i) {
+  switch (static_cast<PerfEvent>(i)) {
+    case PerfEvent::CYCLES: return "cycles";
+    case PerfEvent::INSTRUCTIONS: return "instructions";
+    case PerfEvent::LLC_MISSES: return "LLC-misses";
+    case PerfEvent::DTLB_MISSES: return "dTLB-misses";
+    case PerfEvent::BRANCH_MISSES: return "branch-misses";
+  }
+  return "?";
+}
+
+static void perfEventAttr(PerfEvent e, perf_event_attr* attr) {
+  auto cache = [](uint64_t id) {
+    return id |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  };
+  switch (e) {
+    case PerfEvent::CYCLES:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case PerfEvent::INSTRUCTIONS:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case PerfEvent::LLC_MISSES:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = cache(PERF_COUNT_HW_CACHE_LL);
+      break;
+    case PerfEvent::DTLB_MISSES:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = cache(PERF_COUNT_HW_CACHE_DTLB);
+      break;
+    case PerfEvent::BRANCH_MISSES:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+  }
+}
+
+PerfSample PerfSample::operator-(const PerfSample& other) const {
+  PerfSample r;
+  for (size_t i = 0; i < NUM_PERF_EVENTS; i++) {
+    if (values_[i] < 0 || other.values_[i] < 0) {
+      r.values_[i] = -1;
+    } else {
+      r.values_[i] = values_[i] - other.values_[i];
+    }
+  }
+  return r;
+}
+
+PerfSample& PerfSample::operator+=(const PerfSample& other) {
+  for (size_t i = 0; i < NUM_PERF_EVENTS; i++) {
+    if (values_[i] < 0 || other.values_[i] < 0) {
+      values_[i] = -1;
+    } else {
+      values_[i] += other.values_[i];
+    }
+  }
+  return *this;
+}
+
+PerfCounters::PerfCounters() {
+  for (size_t i = 0; i < NUM_PERF_EVENTS; i++) {
+    perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    perfEventAttr(static_cast<PerfEvent>(i), &attr);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // pid = 0, cpu = -1: the calling thread, on any CPU
+    fds_[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    // Counters are opened on every thread, and if one is unavailable
+    // (e.g., in a container) it usually is everywhere, so only say so
+    // once
+    static std::atomic<bool> warned{false};
+    if (fds_[i] < 0 && !warned.exchange(true)) {
+      KJ_LOG(WARNING, perfEventName(i), "perf_event_open failed; unavailable counters print as n/a",
+             strerror(errno));
+    }
+  }
+}
+
+PerfCounters::~PerfCounters() {
+  for (int fd : fds_) {
+    if (fd >= 0) close(fd);
+  }
+}
+
+PerfSample PerfCounters::read() const {
+  PerfSample r;
+  for (size_t i = 0; i < NUM_PERF_EVENTS; i++) {
+    uint64_t buf[3];  // value, time enabled, time running
+    if (fds_[i] < 0 || ::read(fds_[i], buf, sizeof(buf)) != sizeof(buf)) {
+      r.values_[i] = -1;
+      continue;
+    }
+    if (buf[2] == 0) {
+      r.values_[i] = 0;
+    } else {
+      // Extrapolate if the PMU was multiplexed
+      r.values_[i] = static_cast<int64_t>(
+          static_cast<double>(buf[0]) * buf[1] / buf[2]);
+    }
+  }
+  return r;
+}
+
+PerfCounters& threadPerfCounters() {
+  thread_local PerfCounters counters;
+  return counters;
+}
+
+PerfPhase::PerfPhase(PerfReport* report, kj::StringPtr name, int thread)
+    : report_(report), name_(name), thread_(thread) {
+  if (report_) start_ = threadPerfCounters().read();
+}
+
+PerfPhase::~PerfPhase() {
+  if (report_) report_->add(name_, thread_, threadPerfCounters().read() - start_);
+}
+
+static thread_local PerfSample thread_start;
+
+void PerfReport::beginThread() {
+  if (!enabled_) return;
+  thread_start = threadPerfCounters().read();
+}
+
+void PerfReport::endThread(kj::StringPtr name) {
+  if (!enabled_) return;
+  add(name, omp_get_thread_num(), threadPerfCounters().read() - thread_start);
+}
+
+void PerfReport::add(kj::StringPtr name, int thread, const PerfSample& sample) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.push_back({name, thread, sample});
+}
+
+void PerfReport::print(std::ostream& os) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (entries_.empty()) return;
+
+  // Sum repeated measurements of the same (phase, thread), keeping
+  // phases in order of first appearance
+  std::vector<kj::StringPtr> order;
+  std::map<std::pair<std::string, int>, PerfSample> rows;
+  std::map<std::string, PerfSample> totals;
+  std::map<std::string, int> num_threads;
+  for (const auto& e : entries_) {
+    std::string name = e.name_.cStr();
+    if (!totals.count(name)) order.push_back(e.name_);
+    auto r = rows.emplace(std::make_pair(name, e.thread_), e.sample_);
+    if (!r.second) {
+      r.first->second += e.sample_;
+    } else {
+      num_threads[name]++;
+    }
+    auto t = totals.emplace(name, e.sample_);
+    if (!t.second) t.first->second += e.sample_;
+  }
+
+  auto flags = os.flags();
+  auto precision = os.precision();
+
+  auto printRow = [&](const std::string& name, const std::string& thread, const PerfSample& s) {
+    os << std::left << std::setw(16) << name << std::setw(8) << thread << std::right;
+    for (size_t i = 0; i < NUM_PERF_EVENTS; i++) {
+      if (s.values_[i] < 0) {
+        os << std::setw(16) << "n/a";
+      } else {
+        os << std::setw(16) << s.values_[i];
+      }
+    }
+    auto cycles = s.values_[static_cast<size_t>(PerfEvent::CYCLES)];
+    auto instructions = s.values_[static_cast<size_t>(PerfEvent::INSTRUCTIONS)];
+    if (cycles > 0 && instructions >= 0) {
+      os << std::setw(8) << std::fixed << std::setprecision(2)
+         << static_cast<double>(instructions) / cycles;
+    } else {
+      os << std::setw(8) << "n/a";
+    }
+    os << "\n";
+  };
+
+  os << std::left << std::setw(16) << "phase" << std::setw(8) << "thread" << std::right;
+  for (size_t i = 0; i < NUM_PERF_EVENTS; i++) {
+    os << std::setw(16) << perfEventName(i);
+  }
+  os << std::setw(8) << "IPC" << "\n";
+  for (auto name : order) {
+    std::string n = name.cStr();
+    for (const auto& kv : rows) {
+      if (kv.first.first != n) continue;
+      printRow(n, std::to_string(kv.first.second), kv.second);
+    }
+    if (num_threads[n] > 1) {
+      printRow(n, "total", totals[n]);
+    }
+  }
+
+  os.flags(flags);
+  os.precision(precision);
+}
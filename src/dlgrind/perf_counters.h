@@ -0,0 +1,101 @@
+#pragma once
+
+#include <kj/string.h>
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Hardware performance counters, read with perf_event_open(2).
+//
+// Counters are per thread: each thread that wants to be measured
+// opens its own set (see threadPerfCounters()), and we attribute
+// deltas between two reads to a named phase.  We only count user
+// space, so this works without privileges as long as
+// kernel.perf_event_paranoid <= 2.
+
+enum class PerfEvent : uint8_t {
+  CYCLES,
+  INSTRUCTIONS,
+  LLC_MISSES,
+  DTLB_MISSES,
+  BRANCH_MISSES,
+};
+
+constexpr size_t NUM_PERF_EVENTS = 5;
+
+struct PerfSample {
+  // Scaled for multiplexing; -1 if the event could not be opened
+  std::array<int64_t, NUM_PERF_EVENTS> values_ = {};
+
+  PerfSample operator-(const PerfSample& other) const;
+  PerfSample& operator+=(const PerfSample& other);
+};
+
+// Counters for the thread that constructed this object
+class PerfCounters {
+public:
+  PerfCounters();
+  ~PerfCounters();
+
+  KJ_DISALLOW_COPY(PerfCounters);
+
+  PerfSample read() const;
+
+private:
+  std::array<int, NUM_PERF_EVENTS> fds_;
+};
+
+// Lazily opened counters for the calling thread
+PerfCounters& threadPerfCounters();
+
+class PerfReport;
+
+// Attributes the counters of the calling thread between construction
+// and destruction to a phase.
+class PerfPhase {
+public:
+  PerfPhase(PerfReport* report, kj::StringPtr name, int thread = 0);
+  ~PerfPhase();
+
+  KJ_DISALLOW_COPY(PerfPhase);
+
+private:
+  PerfReport* report_;
+  kj::StringPtr name_;
+  int thread_;
+  PerfSample start_;
+};
+
+class PerfReport {
+public:
+  void setEnabled(bool enabled) { enabled_ = enabled; }
+  bool enabled() const { return enabled_; }
+
+  // No-op scope if counters are disabled.  name must outlive the
+  // report (we expect string literals.)
+  PerfPhase phase(kj::StringPtr name) { return PerfPhase(enabled_ ? this : nullptr, name); }
+
+  // Per thread measurement for code running inside an OpenMP team.
+  // Call beginThread() and endThread() from each thread of the team.
+  void beginThread();
+  void endThread(kj::StringPtr name);
+
+  // Thread safe
+  void add(kj::StringPtr name, int thread, const PerfSample& sample);
+
+  void print(std::ostream& os) const;
+
+private:
+  struct Entry {
+    kj::StringPtr name_;
+    int thread_;
+    PerfSample sample_;
+  };
+
+  bool enabled_ = false;
+  mutable std::mutex mutex_;
+  std::vector<Entry> entries_;
+};
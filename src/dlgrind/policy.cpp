@@ -0,0 +1,220 @@
+#include <dlgrind/policy.h>
+#include <dlgrind/fingerprint.h>
+#include <dlgrind/mmap.h>
+#include <dlgrind/optimizer.h>
+#include <dlgrind/trace.h>
+
+#include <kj/debug.h>
+
+#include <cstring>
+#include <fstream>
+
+#include <unistd.h>
+
+std::optional<partition_t> PolicyTable::partition(
+    const StateLayout& layout, const AdventurerState& st) const {
+  // A field wider than any reachable state's can't be reachable, and
+  // its key could alias one that is
+  if (!layout.fits(st)) return std::nullopt;
+  auto key = layout.pack(st);
+  size_t mask = keys_.size() - 1;
+  for (size_t i = PackedStateHasher()(key) & mask; ; i = (i + 1) & mask) {
+    if (partitions_[i] == NO_PARTITION) return std::nullopt;
+    if (keys_[i] == key) return partitions_[i];
+  }
+}
+
+PolicyTable buildPolicyTable(
+    Simulator& sim, const Automaton& automaton,
+    const PackedStateMap<partition_t>& state_partition, frames_t horizon,
+    PerfReport& perf_report) {
+  // Moves are looked up as actions
+  KJ_REQUIRE(!automaton.macroActions_, "the policy table needs an automaton of single actions");
+  PolicyTable t;
+  t.horizon_ = horizon;
+  t.numPartitions_ = automaton.numPartitions_;
+  const size_t num_partitions = automaton.numPartitions_;
+
+  {
+    auto perf = perf_report.phase("policy-states");
+    TraceSpan trace("policy-states");
+    // At most half full
+    size_t capacity = 1;
+    while (capacity < 2 * state_partition.size()) capacity *= 2;
+    t.keys_ = kj::heapArray<PackedState>(capacity);
+    t.partitions_ = kj::heapArray<partition_t>(capacity);
+    std::fill(t.partitions_.begin(), t.partitions_.end(), PolicyTable::NO_PARTITION);
+    size_t mask = capacity - 1;
+    for (const auto& kv : state_partition) {
+      size_t i = PackedStateHasher()(kv.first) & mask;
+      while (t.partitions_[i] != PolicyTable::NO_PARTITION) i = (i + 1) & mask;
+      t.keys_[i] = kv.first;
+      t.partitions_[i] = kv.second;
+    }
+  }
+
+  EdgeTable edges;
+  {
+    auto perf = perf_report.phase("edge-table");
+    TraceSpan trace("edge-table");
+    edges = buildEdgeTable(sim, automaton);
+  }
+  auto inverse_actions = automaton.inverse_.getActions();
+
+  // Backwards: with b frames left, take the edge that does the most
+  // damage now plus with what is left after it (or stop, if nothing
+  // fits).  Everything with fewer frames left is done, so each b is
+  // parallel over partitions.
+  t.dmg_ = kj::heapArray<float>(static_cast<size_t>(horizon) * num_partitions);
+  t.actions_ = kj::heapArray<uint8_t>(static_cast<size_t>(horizon) * num_partitions);
+  {
+    auto perf = perf_report.phase("policy");
+    #pragma omp parallel
+    perf_report.beginThread();
+    for (frames_t b = 0; b < horizon; b++) {
+      #pragma omp parallel
+      {
+        TraceSpan trace("policy-chunk", b);
+        #pragma omp for nowait
+        for (size_t p = 0; p < num_partitions; p++) {
+          double best = 0;
+          uint8_t best_action = PolicyTable::NO_ACTION;
+          for (uint32_t i = edges.forwardIndex_[p]; i < edges.forwardIndex_[p+1]; i++) {
+            uint32_t j = edges.forwardEdges_[i];
+            frames_t frames = edges.frames_[j];
+            if (frames > b) continue;
+            double v = edges.dmg_[j] + t.dmg_[(b - frames) * num_partitions + edges.target_[j]];
+            if (v > best) {
+              best = v;
+              best_action = inverse_actions[j];
+            }
+          }
+          t.dmg_[b * num_partitions + p] = best;
+          t.actions_[b * num_partitions + p] = best_action;
+        }
+      }
+    }
+    #pragma omp parallel
+    perf_report.endThread("policy");
+  }
+  KJ_LOG(INFO, horizon, num_partitions, state_partition.size(), "built policy table");
+  return t;
+}
+
+// Bump whenever the table construction or the file format changes
+static constexpr uint32_t POLICY_VERSION = 1;
+
+uint64_t policyFingerprint(const Simulator& sim, AdventurerState init) {
+  Fingerprint fp;
+  fp.add(POLICY_VERSION);
+  fp.add(automatonFingerprint(sim, init));
+  fp.add(sim.params().hitDmgTable_);
+  return fp.h_;
+}
+
+// File
+
+namespace {
+
+struct PolicyFileHeader {
+  char magic_[8];
+  uint32_t version_;
+  uint32_t stateSize_;  // sizeof(PackedState)
+  uint64_t fingerprint_;
+  uint32_t horizon_;
+  uint32_t numPartitions_;
+  uint64_t capacity_;
+};
+
+constexpr char POLICY_MAGIC[8] = "DLGPOLI";
+
+// Offsets of each array in the file
+struct PolicyFileLayout {
+  PolicyFileLayout(uint64_t capacity, uint32_t horizon, uint32_t num_partitions) {
+    size_t cells = static_cast<size_t>(horizon) * num_partitions;
+    keys_ = align8(sizeof(PolicyFileHeader));
+    partitions_ = align8(keys_ + capacity * sizeof(PackedState));
+    dmg_ = align8(partitions_ + capacity * sizeof(partition_t));
+    actions_ = align8(dmg_ + cells * sizeof(float));
+    size_ = actions_ + cells * sizeof(uint8_t);
+  }
+  size_t keys_, partitions_, dmg_, actions_, size_;
+};
+
+}  // namespace
+
+void writePolicyTable(kj::StringPtr path, uint64_t fingerprint, const PolicyTable& table) {
+  TraceSpan trace("write-policy");
+  PolicyFileLayout layout(table.keys_.size(), table.horizon_, table.numPartitions_);
+
+  PolicyFileHeader header;
+  memcpy(header.magic_, POLICY_MAGIC, sizeof(header.magic_));
+  header.version_ = POLICY_VERSION;
+  header.stateSize_ = sizeof(PackedState);
+  header.fingerprint_ = fingerprint;
+  header.horizon_ = table.horizon_;
+  header.numPartitions_ = table.numPartitions_;
+  header.capacity_ = table.keys_.size();
+
+  // Write to a temporary and rename, so readers never see a partial
+  // file
+  auto tmp_path = kj::str(path, ".tmp.", getpid());
+  {
+    std::ofstream os(tmp_path.cStr(), std::ios::binary);
+    KJ_REQUIRE(os.good(), tmp_path, "could not open policy file");
+    size_t pos = 0;
+    auto write = [&](size_t offset, const void* p, size_t n) {
+      static const char zeros[8] = {};
+      KJ_ASSERT(offset >= pos && offset - pos < 8);
+      os.write(zeros, offset - pos);
+      os.write(static_cast<const char*>(p), n);
+      pos = offset + n;
+    };
+    write(0, &header, sizeof(header));
+    write(layout.keys_, table.keys_.begin(), table.keys_.size() * sizeof(PackedState));
+    write(layout.partitions_, table.partitions_.begin(), table.partitions_.size() * sizeof(partition_t));
+    write(layout.dmg_, table.dmg_.begin(), table.dmg_.size() * sizeof(float));
+    write(layout.actions_, table.actions_.begin(), table.actions_.size() * sizeof(uint8_t));
+    KJ_ASSERT(pos == layout.size_, pos, layout.size_);
+    KJ_REQUIRE(os.good(), tmp_path, "could not write policy file");
+  }
+  KJ_SYSCALL(rename(tmp_path.cStr(), path.cStr()), tmp_path, path);
+  KJ_LOG(INFO, path, layout.size_, "wrote policy table");
+}
+
+std::optional<PolicyTable> loadPolicyTable(kj::StringPtr path, uint64_t fingerprint) {
+  TraceSpan trace("load-policy");
+  auto mb_mapping = mmapFile(path);
+  if (!mb_mapping || mb_mapping->size() < sizeof(PolicyFileHeader)) {
+    return std::nullopt;
+  }
+  size_t size = mb_mapping->size();
+
+  PolicyTable t;
+  t.backing_ = kj::mv(*mb_mapping);
+  auto* base = t.backing_.begin();
+
+  PolicyFileHeader header;
+  memcpy(&header, base, sizeof(header));
+  if (memcmp(header.magic_, POLICY_MAGIC, sizeof(header.magic_)) != 0 ||
+      header.version_ != POLICY_VERSION ||
+      header.stateSize_ != sizeof(PackedState) ||
+      header.fingerprint_ != fingerprint) {
+    KJ_LOG(WARNING, path, "policy file is for a different config or build");
+    return std::nullopt;
+  }
+  PolicyFileLayout layout(header.capacity_, header.horizon_, header.numPartitions_);
+  if (layout.size_ != size) {
+    KJ_LOG(WARNING, path, layout.size_, size, "policy file is truncated");
+    return std::nullopt;
+  }
+
+  size_t cells = static_cast<size_t>(header.horizon_) * header.numPartitions_;
+  t.horizon_ = header.horizon_;
+  t.numPartitions_ = header.numPartitions_;
+  t.keys_ = mmapView<PackedState>(base, layout.keys_, header.capacity_);
+  t.partitions_ = mmapView<partition_t>(base, layout.partitions_, header.capacity_);
+  t.dmg_ = mmapView<float>(base, layout.dmg_, cells);
+  t.actions_ = mmapView<uint8_t>(base, layout.actions_, cells);
+  return std::move(t);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <dlgrind/automaton.h>
+#include <dlgrind/perf_counters.h>
+#include <dlgrind/simulator.h>
+#include <dlgrind/state.h>
+
+#include <kj/array.h>
+#include <kj/string.h>
+
+#include <cstdint>
+#include <optional>
+
+// Value to go: for every partition and every number of frames left
+// (below the horizon), the most damage still achievable and the next
+// action that achieves it.  This answers "what now?" from any state
+// reachable from the initial state, not just the start of the fight.
+//
+// The table is computed backwards over the automaton.  States are
+// looked up by their packed representation in an open addressing
+// table of every reachable state, so a query is a hash and a few
+// reads, with no simulation.
+struct PolicyMove {
+  std::optional<Action> action_;  // nullopt: no action finishes in time
+  float dmg_ = 0;  // damage still to come
+};
+
+class PolicyTable {
+public:
+  PolicyTable() {}
+  KJ_DISALLOW_COPY(PolicyTable);
+  PolicyTable(PolicyTable&&) = default;
+  PolicyTable& operator=(PolicyTable&&) = default;
+
+  frames_t horizon() const { return horizon_; }
+  uint32_t numPartitions() const { return numPartitions_; }
+
+  // nullopt if st is not reachable from the initial state
+  std::optional<partition_t> partition(const StateLayout& layout, const AdventurerState& st) const;
+
+  PolicyMove move(partition_t p, frames_t frames_left) const {
+    KJ_REQUIRE(frames_left < horizon_, frames_left, horizon_);
+    size_t i = static_cast<size_t>(frames_left) * numPartitions_ + p;
+    PolicyMove r;
+    if (actions_[i] != NO_ACTION) r.action_ = static_cast<Action>(actions_[i]);
+    r.dmg_ = dmg_[i];
+    return r;
+  }
+
+  std::optional<PolicyMove> query(
+      const StateLayout& layout, const AdventurerState& st, frames_t frames_left) const {
+    auto p = partition(layout, st);
+    if (!p) return std::nullopt;
+    return move(*p, frames_left);
+  }
+
+private:
+  static constexpr uint8_t NO_ACTION = 0xFF;
+  static constexpr partition_t NO_PARTITION = 0xFFFFFFFF;
+
+  friend PolicyTable buildPolicyTable(
+      Simulator&, const Automaton&, const PackedStateMap<partition_t>&, frames_t, PerfReport&);
+  friend void writePolicyTable(kj::StringPtr, uint64_t, const PolicyTable&);
+  friend std::optional<PolicyTable> loadPolicyTable(kj::StringPtr, uint64_t);
+
+  // Backing storage (e.g., a mapped file) that the arrays below may
+  // point into; declared first so it is released last
+  kj::Array<kj::byte> backing_;
+
+  frames_t horizon_ = 0;
+  uint32_t numPartitions_ = 0;
+  // Open addressing over a power of two capacity; NO_PARTITION marks
+  // a free slot
+  kj::Array<PackedState> keys_;
+  kj::Array<partition_t> partitions_;
+  // Indexed by frames_left * numPartitions_ + partition
+  kj::Array<float> dmg_;
+  kj::Array<uint8_t> actions_;
+};
+
+// state_partition is the mapping buildAutomaton fills in
+PolicyTable buildPolicyTable(
+    Simulator& sim, const Automaton& automaton,
+    const PackedStateMap<partition_t>& state_partition, frames_t horizon, PerfReport& perf);
+
+// Hash of everything the table depends on besides the horizon (which
+// the file records): the automaton's fingerprint and the damage
+// numbers
+uint64_t policyFingerprint(const Simulator& sim, AdventurerState init);
+
+// A flat file, like the automaton cache: a header followed by the
+// arrays, so loading is mapping.  Loading returns nullopt if the file
+// is missing or was written for a different fingerprint.
+void writePolicyTable(kj::StringPtr path, uint64_t fingerprint, const PolicyTable& table);
+std::optional<PolicyTable> loadPolicyTable(kj::StringPtr path, uint64_t fingerprint);
@@ -0,0 +1,133 @@
+#include <dlgrind/rotation.h>
+#include <dlgrind/trace.h>
+
+#include <array>
+#include <cctype>
+#include <cstring>
+
+bool parseActionToken(kj::StringPtr action, std::vector<Action>* out) {
+  if (action == "fs") {
+    out->emplace_back(Action::FS);
+  } else if (action == "x") {
+    out->emplace_back(Action::X);
+  } else if (action == "s1") {
+    out->emplace_back(Action::S1);
+  } else if (action == "s2") {
+    out->emplace_back(Action::S2);
+  } else if (action == "s3") {
+    out->emplace_back(Action::S3);
+  } else if (action.startsWith("c")) {
+    bool fs = action.endsWith("fs");
+    size_t end = fs ? action.size() - 2 : action.size();
+    if (end <= 1) return false;
+    uint32_t count = 0;
+    for (size_t i = 1; i < end; i++) {
+      if (!isdigit(action[i])) return false;
+      count = count * 10 + (action[i] - '0');
+      if (count > 255) return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      out->emplace_back(Action::X);
+    }
+    if (fs) {
+      out->emplace_back(Action::FS);
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::optional<std::vector<Action>> parseRotation(kj::StringPtr line) {
+  std::vector<Action> rotation;
+  const char* p = line.begin();
+  const char* end = strstr(line.cStr(), "=>");
+  if (end == nullptr) end = line.end();
+  for (;;) {
+    while (p < end && isspace(*p)) p++;
+    if (p == end) break;
+    const char* q = p;
+    while (q < end && !isspace(*q)) q++;
+    if (!parseActionToken(kj::heapString(p, q - p), &rotation)) {
+      return std::nullopt;
+    }
+    p = q;
+  }
+  return rotation;
+}
+
+namespace {
+
+struct TrieNode {
+  uint32_t parent_ = 0;
+  Action action_ = Action::X;
+  // 0 if absent (the root is never anyone's child)
+  std::array<uint32_t, NUM_ACTIONS> children_ = {};
+  AdventurerState state_;
+  RotationResult result_;
+};
+
+}  // namespace
+
+std::vector<RotationResult> simulateRotations(
+    Simulator& sim, AdventurerState init,
+    const std::vector<std::vector<Action>>& rotations) {
+  TraceSpan trace("simulate-rotations", rotations.size());
+
+  // Build the trie, remembering which node each rotation ends at and
+  // the nodes at each depth
+  std::vector<TrieNode> nodes(1);
+  nodes[0].state_ = init;
+  std::vector<std::vector<uint32_t>> levels(1, {0});
+  std::vector<uint32_t> leaves;
+  leaves.reserve(rotations.size());
+  for (const auto& rotation : rotations) {
+    uint32_t n = 0;
+    for (size_t d = 0; d < rotation.size(); d++) {
+      auto a = rotation[d];
+      uint32_t child = nodes[n].children_[toIndex(a)];
+      if (!child) {
+        child = nodes.size();
+        nodes[n].children_[toIndex(a)] = child;
+        nodes.emplace_back();
+        nodes.back().parent_ = n;
+        nodes.back().action_ = a;
+        if (levels.size() <= d + 1) levels.emplace_back();
+        levels[d + 1].emplace_back(child);
+      }
+      n = child;
+    }
+    leaves.emplace_back(n);
+  }
+  KJ_LOG(INFO, rotations.size(), nodes.size(), "rotation trie");
+
+  // Every node only depends on its parent, so a level at a time
+  for (size_t d = 1; d < levels.size(); d++) {
+    const auto& level = levels[d];
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (size_t i = 0; i < level.size(); i++) {
+      auto& node = nodes[level[i]];
+      const auto& parent = nodes[node.parent_];
+      node.result_ = parent.result_;
+      if (!parent.result_.valid_) continue;
+      frames_t frames;
+      double dmg;
+      auto mb_st = sim.applyAction(parent.state_, node.action_, &frames, &dmg);
+      if (!mb_st) {
+        node.result_.valid_ = false;
+        node.result_.failedAt_ = d - 1;
+        continue;
+      }
+      node.state_ = *mb_st;
+      node.result_.frames_ += frames;
+      node.result_.dmg_ += dmg;
+    }
+  }
+
+  std::vector<RotationResult> results;
+  results.reserve(leaves.size());
+  for (auto n : leaves) {
+    results.emplace_back(nodes[n].result_);
+  }
+  return results;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <dlgrind/schema.capnp.h>
+#include <dlgrind/simulator.h>
+#include <dlgrind/state.h>
+
+#include <kj/string.h>
+
+#include <optional>
+#include <vector>
+
+// Rotations in the syntax dlgrind-opt prints (and logs/*.log record):
+// whitespace separated fs, x, s1, s2, s3, cN (N basic combos) and
+// cNfs (N basic combos, then a force strike).
+
+// Append the actions for one token to out; false if the token is not
+// an action
+bool parseActionToken(kj::StringPtr token, std::vector<Action>* out);
+
+// Parse a whole rotation, ignoring anything from "=>" on (so lines
+// of dlgrind-opt output can be fed back in).  nullopt if any token is
+// not an action.
+std::optional<std::vector<Action>> parseRotation(kj::StringPtr line);
+
+struct RotationResult {
+  bool valid_ = true;
+  // Index of the first illegal action, if !valid_
+  size_t failedAt_ = 0;
+  frames_t frames_ = 0;
+  double dmg_ = 0;
+};
+
+// Simulate every rotation from init.  Rotations are put in a trie, so
+// a common prefix is only simulated once; each level of the trie is
+// simulated in parallel.
+std::vector<RotationResult> simulateRotations(
+    Simulator& sim, AdventurerState init,
+    const std::vector<std::vector<Action>>& rotations);
@@ -1,18 +1,14 @@
 #include <dlgrind/simulator.h>
+#include <dlgrind/effects.h>
 
+#include <magic_enum.h>
+
+#include <algorithm>
 #include <cmath>
+#include <limits>
 
 // Indexed stat retrieval
 
-// Uses up both buff slots
-AdventurerState buffAllowDoubleStack(AdventurerState after, frames_t buff_frames) {
-  if (after.buffFramesLeft_[1] > 0) {
-    after.buffFramesLeft_[0] = after.buffFramesLeft_[1];
-  }
-  after.buffFramesLeft_[1] = buff_frames;
-  return after;
-};
-
 ActionStat::Reader Simulator::getComboStat(size_t i) {
   return config_->getWeaponClass().getXStats()[i];
 }
@@ -76,14 +72,6 @@ static std::optional<size_t> skillIndex(Action a) {
   }
 }
 
-static uint8_t getSkillPrep(AdventurerName name) {
-  switch (name) {
-    case AdventurerName::HEINWALD: return 100;
-    case AdventurerName::AMANE: return 75;
-    default: return 0;
-  }
-}
-
 // State machine transition function
 
 uint32_t Simulator::afterActionSp(AfterAction after) {
@@ -125,6 +113,270 @@ double Simulator::afterActionDmg(AfterAction after) {
 }
 
 
+static AfterAction nextAfterAction(AfterAction prev, Action a) {
+  switch (a) {
+    case Action::FS:
+      return AfterAction::AFTER_FS;
+    case Action::X:
+      switch (prev) {
+        case AfterAction::AFTER_C1:
+          return AfterAction::AFTER_C2;
+        case AfterAction::AFTER_C2:
+          return AfterAction::AFTER_C3;
+        case AfterAction::AFTER_C3:
+          return AfterAction::AFTER_C4;
+        case AfterAction::AFTER_C4:
+          return AfterAction::AFTER_C5;
+        default:
+          return AfterAction::AFTER_C1;
+      }
+    case Action::S1:
+      return AfterAction::AFTER_S1;
+    case Action::S2:
+      return AfterAction::AFTER_S2;
+    case Action::S3:
+      return AfterAction::AFTER_S3;
+  }
+  KJ_UNREACHABLE;
+}
+
+// Damage of the hit that leads to after.afterAction_, when a is the
+// action being taken.  Only depends on the parts of the state that
+// dmgKey picks out, so this is only run to fill in hitDmgTable_.
+static double computeHitDmg(
+    const EffectTable& E, const SimParams& params, const AdventurerState& after, Action a) {
+  const auto mb_after_skill = afterSkillIndex(after.afterAction_);
+  //  (NB: some units have to compute damage after skill effects;
+  //  e.g., Alfonse S1 and Serena. Be careful!)
+  double dmg = params.strength_;
+  // strength buffs
+  for (size_t slot = 0; slot < 3; slot++) {
+    if (E.strengthBuff_[slot] != 1 && after.buffFramesLeft_[slot] > 0) {
+      dmg *= E.strengthBuff_[slot];
+    }
+  }
+  // modifier
+  double mod = params.hitDmg_[toIndex(after.afterAction_)];
+  for (const auto& o : E.dmgOverrides_) {
+    if (o.cond_ == DmgCondition::NONE || o.after_ != after.afterAction_) continue;
+    bool match = false;
+    switch (o.cond_) {
+      case DmgCondition::NONE:
+        break;
+      case DmgCondition::SKILL_SHIFT:
+        match = mb_after_skill && *mb_after_skill < 2 &&
+          after.skillShift_[*mb_after_skill] == o.arg_;
+        break;
+      case DmgCondition::FS_BUFF:
+        match = after.fsBuff_;
+        break;
+      case DmgCondition::NO_AFFLICTION:
+        match = after.afflictionFramesLeft_ == 0;
+        break;
+    }
+    if (match) {
+      mod = o.mod_;
+      break;
+    }
+  }
+  dmg *= mod;
+  if (skillIndex(a)) {
+    dmg *= params.skillDmg_;
+    // skill dmg buffs here:
+    // (none)
+  } else if (a == Action::FS) {
+    dmg *= params.fsDmg_;
+  }
+  // punisher
+  if (E.punisher_ != 1 && after.afflictionFramesLeft_ > 0) {
+    dmg *= E.punisher_;
+  }
+  // energy
+  if (E.energyMax_ && after.energy_ == E.energyMax_) {
+    dmg *= E.energizedDmg_;
+  }
+  // crit, and the constant factors
+  dmg *= params.critFactor_[params.s3BuffFrames_ && after.buffFramesLeft_[2] > 0];
+  /*
+  // ODPS
+  if (after.afterAction_ == AfterAction::AFTER_FS) {
+    // NB: Need to handle Yachiyo adjustment here
+    dmg *= 4;
+  }
+  */
+  return dmg;
+}
+
+// Index into hitDmgTable_; see SimParams
+static size_t dmgKey(const SimParams& params, const AdventurerState& st, Action a) {
+  auto mb_after_skill = afterSkillIndex(st.afterAction_);
+  size_t key = toIndex(st.afterAction_);
+  key = key * 3 + (skillIndex(a) ? 2 : a == Action::FS ? 1 : 0);
+  key = key * 8 + (st.buffFramesLeft_[0] > 0) +
+    2 * (st.buffFramesLeft_[1] > 0) + 4 * (st.buffFramesLeft_[2] > 0);
+  key = key * 2 + (params.energyMax_ && st.energy_ == params.energyMax_);
+  key = key * 3 + (mb_after_skill && *mb_after_skill < 2 ? st.skillShift_[*mb_after_skill] : 0);
+  key = key * 2 + (st.fsBuff_ != 0);
+  key = key * 2 + (st.afflictionFramesLeft_ > 0);
+  return key;
+}
+
+// Parameter extraction
+
+// A buff timer, rounded to the bucket
+static uint32_t roundTimer(uint32_t frames, const SimParams& params) {
+  uint32_t down = frames - frames % params.timerBucket_;
+  if (params.rounding_ == ApproxRounding::OPTIMISTIC && down != frames) {
+    return down + params.timerBucket_;
+  }
+  return down;
+}
+
+static AdventurerState roundTimers(AdventurerState st, const SimParams& params) {
+  for (auto& t : st.buffFramesLeft_) {
+    t = roundTimer(t, params);
+  }
+  return st;
+}
+
+// SP just short of a skill's cost, rounded to the tolerance
+static AdventurerState roundSp(AdventurerState st, const SimParams& params) {
+  for (size_t i = 0; i < params.numSkills_; i++) {
+    uint16_t cost = params.skillSp_[i];
+    uint16_t tolerance = std::min(params.spTolerance_, cost);
+    if (st.sp_[i] >= cost || st.sp_[i] + tolerance < cost) continue;
+    st.sp_[i] = params.rounding_ == ApproxRounding::OPTIMISTIC ? cost : cost - tolerance;
+  }
+  return st;
+}
+
+void Simulator::refreshParams() {
+  SimParams p;
+  auto adventurer = config_->getAdventurer();
+  auto mods = adventurer.getModifiers();
+  auto coab_mods = adventurer.getCoabilityModifiers();
+
+  p.adventurer_ = adventurer.getName();
+  p.weaponType_ = config_->getWeapon().getWtype();
+  p.numSkills_ = getNumSkills();
+  for (size_t i = 0; i < 3; i++) {
+    p.skillSp_[i] = getSkillStat(i).getSp();
+  }
+
+  float haste = mods.getSkillHaste();
+  // skill haste buffs here:
+  // (currently none)
+  bool projectile = false;
+  switch (config_->getWeapon().getWtype()) {
+    case WeaponType::STAFF:
+    case WeaponType::WAND:
+    case WeaponType::BOW:
+      // TODO: Handle Bow FS
+      projectile = true;
+      break;
+    default:
+      break;
+  }
+  for (auto after : magic_enum::enum_values<AfterAction>()) {
+    size_t i = toIndex(after);
+    p.hitSp_[i] = static_cast<uint16_t>(
+        ceil(static_cast<float>(afterActionSp(after)) * (1. + haste)));
+    p.hitDmg_[i] = afterActionDmg(after) / 100.;
+    // TODO: Some skills have delays
+    if (projectile && (afterComboIndex(after) || after == AfterAction::AFTER_FS)) {
+      p.hitDelay_[i] = projectile_delay_;
+    }
+    for (auto a : magic_enum::enum_values<Action>()) {
+      size_t j = toIndex(a);
+      p.next_[i][j] = nextAfterAction(after, a);
+      p.recoveryFrames_[i][j] = prevRecoveryFrames(after, a);
+      p.startupFrames_[i][j] = afterStartupFrames(after, a, p.next_[i][j]);
+    }
+  }
+  // Over every (prev, action) pair, legal or not; an action that
+  // takes no time would never advance the DP, so there is none
+  p.minActionFrames_ = std::numeric_limits<frames_t>::max();
+  for (size_t i = 0; i < NUM_AFTER_ACTIONS; i++) {
+    for (size_t j = 0; j < NUM_ACTIONS; j++) {
+      frames_t frames = p.recoveryFrames_[i][j] + p.startupFrames_[i][j];
+      if (frames > 0) p.minActionFrames_ = std::min(p.minActionFrames_, frames);
+    }
+  }
+  p.uiHiddenFrames_ = ui_hidden_frames_;
+  // Otherwise an optimistic timer could be rounded back up after
+  // every action and never run out (see setTimerBucket)
+  KJ_REQUIRE(timer_bucket_ <= p.minActionFrames_, timer_bucket_, p.minActionFrames_,
+             "timer bucket is longer than the shortest action");
+  p.timerBucket_ = timer_bucket_;
+  p.rounding_ = approx_rounding_;
+  p.minHitSp_ = 0;
+  for (auto sp : p.hitSp_) {
+    if (sp > 0 && (p.minHitSp_ == 0 || sp < p.minHitSp_)) p.minHitSp_ = sp;
+  }
+  KJ_REQUIRE(sp_tolerance_ <= p.minHitSp_, sp_tolerance_, p.minHitSp_,
+             "SP tolerance is more than the smallest hit gains");
+  p.spTolerance_ = sp_tolerance_;
+
+  switch (config_->getWeapon().getName()) {
+    case WeaponName::AXE5B1:
+      p.s3BuffFrames_ = 20 * 60;
+      break;
+    default:
+      break;
+  }
+
+  p.strength_ = 5./3 * adventurer.getBaseStrength() *
+    (1. + mods.getStrength()) * (1. + coab_mods.getStrength());
+  p.skillDmg_ = (1. + mods.getSkillDmg()) * (1. + coab_mods.getSkillDmg());
+  p.fsDmg_ = 1. + mods.getFsDmg();
+  double crit_rate = mods.getCritRate() + coab_mods.getCritRate();
+  double crit_dmg = mods.getCritDmg() + 0.7;
+  p.critFactor_[0] = (1 + crit_rate * crit_dmg) * 1.5 / 10.;
+  // crit buffs here:
+  p.critFactor_[1] = (1 + crit_rate * (crit_dmg + 0.50)) * 1.5 / 10.;
+
+  const EffectTable effects = adventurerEffects(adventurer.getName());
+  p.skillPrep_ = effects.skillPrep_;
+  p.energyMax_ = effects.energyMax_;
+
+  // Damage of every hit we can possibly see, over a representative
+  // state for each key
+  for (auto after : magic_enum::enum_values<AfterAction>()) {
+    for (auto a : magic_enum::enum_values<Action>()) {
+      for (uint8_t buffs = 0; buffs < 8; buffs++) {
+        for (uint8_t energized = 0; energized < 2; energized++) {
+          for (uint8_t shift = 0; shift < 3; shift++) {
+            for (uint8_t fs_buff = 0; fs_buff < 2; fs_buff++) {
+              for (uint8_t afflicted = 0; afflicted < 2; afflicted++) {
+                AdventurerState st;
+                st.afterAction_ = after;
+                for (size_t slot = 0; slot < 3; slot++) {
+                  st.buffFramesLeft_[slot] = (buffs >> slot) & 1;
+                }
+                st.energy_ = energized ? p.energyMax_ : 0;
+                st.skillShift_[0] = st.skillShift_[1] = shift;
+                st.fsBuff_ = fs_buff;
+                st.afflictionFramesLeft_ = afflicted;
+                p.hitDmgTable_[dmgKey(p, st, a)] = computeHitDmg(effects, p, st, a);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  auto field_max = stateFieldMax(
+      effects, p.numSkills_, p.skillSp_, p.uiHiddenFrames_, p.s3BuffFrames_);
+  for (auto f : {StateField::BUFF0, StateField::BUFF1, StateField::BUFF2}) {
+    auto& m = field_max[static_cast<size_t>(f)];
+    m = roundTimer(m, p);
+  }
+  layout_ = StateLayout(field_max);
+
+  params_ = p;
+}
+
 /*
  * The most important picture
  *     _____________________________.  when the action actually happens
@@ -134,7 +386,58 @@ double Simulator::afterActionDmg(AfterAction after) {
  *
  */
 
-std::optional<AdventurerState> Simulator::applyAction(
+// Kernel selection
+
+template <AdventurerName N>
+static constexpr EffectTable EFFECTS = adventurerEffects(N);
+
+static constexpr auto ADVENTURER_NAMES = magic_enum::enum_values<AdventurerName>();
+static constexpr auto WEAPON_TYPES = magic_enum::enum_values<WeaponType>();
+static constexpr size_t MAX_SKILLS = 3;
+
+// Kernel i is for (ADVENTURER_NAMES[i / (|WEAPON_TYPES| * MAX_SKILLS)],
+// WEAPON_TYPES[i / MAX_SKILLS % |WEAPON_TYPES|], i % MAX_SKILLS + 1)
+#define KERNEL_ARGS(I) \
+  ADVENTURER_NAMES[I / (WEAPON_TYPES.size() * MAX_SKILLS)], \
+  WEAPON_TYPES[I / MAX_SKILLS % WEAPON_TYPES.size()], \
+  I % MAX_SKILLS + 1
+
+template <size_t... I>
+Simulator::Kernels Simulator::kernelsFor(size_t i, std::index_sequence<I...>) {
+  static constexpr Kernels kernels[] = {
+    {
+      &Simulator::applyActionImpl<KERNEL_ARGS(I)>,
+      &Simulator::applyActionBatchImpl<KERNEL_ARGS(I)>,
+    }...
+  };
+  return kernels[i];
+}
+
+#undef KERNEL_ARGS
+
+// Return the index of an enum in magic_enum::enum_values
+template <typename T>
+static size_t enumIndex(T val) {
+  size_t i = 0;
+  for (auto v : magic_enum::enum_values<T>()) {
+    if (v == val) return i;
+    i++;
+  }
+  KJ_FAIL_REQUIRE(val, "invalid enum");
+}
+
+void Simulator::selectKernels() {
+  size_t num_skills = getNumSkills();
+  KJ_REQUIRE(num_skills >= 1 && num_skills <= MAX_SKILLS, num_skills);
+  size_t i = (enumIndex(adventurerName()) * WEAPON_TYPES.size() +
+              enumIndex(config_->getWeapon().getWtype())) * MAX_SKILLS +
+             (num_skills - 1);
+  kernels_ = kernelsFor(i,
+      std::make_index_sequence<ADVENTURER_NAMES.size() * WEAPON_TYPES.size() * MAX_SKILLS>());
+}
+
+template <AdventurerName N, WeaponType W, size_t S>
+std::optional<AdventurerState> Simulator::applyActionImpl(
     AdventurerState prev, Action a, frames_t* frames_out, double* dmg_out) {
 
   if (dmg_out) *dmg_out = 0;
@@ -156,11 +459,11 @@ std::optional<AdventurerState> Simulator::applyAction(
 
   // Apply delayed hits, if applicable
 
-  frames_t hit_delay = hitDelay(prev.afterAction_);
-  frames_t prevFrames = prevRecoveryFrames(prev.afterAction_, a);
+  frames_t hit_delay = hitDelay<W>(prev.afterAction_);
+  frames_t prevFrames = params_.recoveryFrames_[toIndex(prev.afterAction_)][toIndex(a)];
 
   if (hit_delay > 0 && hit_delay <= prevFrames) {
-    after = applyHit(after, a, dmg_out);
+    after = applyHit<N, W, S>(after, a, dmg_out);
   }
 
   // Wait for recovery to see if we can legally skill
@@ -177,246 +480,203 @@ std::optional<AdventurerState> Simulator::applyAction(
       after.advanceFrames(delayFrames);
       frames += delayFrames;
     }
-    if (after.sp_[*mb_skill_index] < getSkillStat(*mb_skill_index).getSp()) {
+    if (after.sp_[*mb_skill_index] < params_.skillSp_[*mb_skill_index]) {
       return std::nullopt;
     }
     KJ_ASSERT(after.uiHiddenFramesLeft_ == 0);
-    after.uiHiddenFramesLeft_ = ui_hidden_frames_;
+    after.uiHiddenFramesLeft_ = params_.uiHiddenFrames_;
     after.sp_[*mb_skill_index] = 0;
   }
 
   if (hit_delay > prevFrames) {
-    after = applyHit(after, a, dmg_out);
+    after = applyHit<N, W, S>(after, a, dmg_out);
   }
 
   // Apply state machine change
-  switch (a) {
-    case Action::FS:
-      after.afterAction_ = AfterAction::AFTER_FS;
-      break;
-    case Action::X:
-      switch (prev.afterAction_) {
-        case AfterAction::AFTER_C1:
-          after.afterAction_ = AfterAction::AFTER_C2;
-          break;
-        case AfterAction::AFTER_C2:
-          after.afterAction_ = AfterAction::AFTER_C3;
-          break;
-        case AfterAction::AFTER_C3:
-          after.afterAction_ = AfterAction::AFTER_C4;
-          break;
-        case AfterAction::AFTER_C4:
-          after.afterAction_ = AfterAction::AFTER_C5;
-          break;
-        default:
-          after.afterAction_ = AfterAction::AFTER_C1;
-          break;
-      }
-      break;
-    case Action::S1:
-      after.afterAction_ = AfterAction::AFTER_S1;
-      break;
-    case Action::S2:
-      after.afterAction_ = AfterAction::AFTER_S2;
-      break;
-    case Action::S3:
-      after.afterAction_ = AfterAction::AFTER_S3;
-      break;
-  }
-
+  after.afterAction_ = params_.next_[toIndex(prev.afterAction_)][toIndex(a)];
 
   // Account for startup cost in UI
-  frames_t afterFrames = afterStartupFrames(prev.afterAction_, a, after.afterAction_);
+  frames_t afterFrames = params_.startupFrames_[toIndex(prev.afterAction_)][toIndex(a)];
   after.advanceFrames(afterFrames);
   frames += afterFrames;
 
   // Not enough memory to handle this
   // KJ_ASSERT(hit_delay < prevFrames + afterFrames, hit_delay, prevFrames, afterFrames);
 
-  if (hitDelay(after.afterAction_) == 0) {
-    after = applyHit(after, a, dmg_out);
+  if (hitDelay<W>(after.afterAction_) == 0) {
+    after = applyHit<N, W, S>(after, a, dmg_out);
   }
 
-  // Apply skill effects
-  switch (a) {
-    case Action::S1:
-      switch (adventurerName()) {
-        case AdventurerName::YACHIYO:
-          break;
-        default:
-          break;
-      }
-      break;
-    case Action::S2:
-      switch (adventurerName()) {
-        case AdventurerName::HEINWALD:
-        case AdventurerName::AMANE:
-          after = buffAllowDoubleStack(after, 10 * 60);
-          break;
-        case AdventurerName::YACHIYO:
-          after.fsBuff_ = 1;
-        default:
-          break;
-      }
-      break;
-    case Action::S3:
-      switch (config_->getWeapon().getName()) {
-        case WeaponName::AXE5B1:
-          after.buffFramesLeft_[2] = 20 * 60;
-          break;
-        default:
-          break;
-      }
-      break;
-    default:
-      break;
+  after = applySkillEffects<N>(after, a);
+
+  if (params_.timerBucket_ > 1) {
+    after = roundTimers(after, params_);
+  }
+  if (params_.spTolerance_ > 0) {
+    after = roundSp(after, params_);
   }
 
   if (frames_out) *frames_out = frames;
   return after;
 }
 
-AdventurerState Simulator::applyHit(AdventurerState after, Action a, double* dmg_out) {
-  // Apply skill SP change
-  float haste = config_->getAdventurer().getModifiers().getSkillHaste();
-  // skill haste buffs here:
-  // (currently none)
-  for (size_t i = 0; i < getNumSkills(); i++) {
-    uint16_t new_sp = after.sp_[i] +
-      static_cast<uint16_t>(ceil(static_cast<float>(afterActionSp(after.afterAction_)) * (1. + haste)));
-    if (new_sp > getSkillStat(i).getSp()) {
-      after.sp_[i] = getSkillStat(i).getSp();
-    } else {
-      after.sp_[i] = new_sp;
+template <AdventurerName N, WeaponType W, size_t S>
+void Simulator::applyActionBatchImpl(
+    const AdventurerStateBatch& prev, Action a, AdventurerStateBatch* after_out,
+    std::vector<frames_t>* frames_out, std::vector<double>* dmg_out,
+    std::vector<uint8_t>* valid_out) {
+  // This follows applyActionImpl step by step, but each step is a
+  // pass over the whole batch.  The timer and SP arithmetic is
+  // straight-line and vectorizes; hits and skill effects (where all
+  // the per-adventurer branching lives) are done one state at a time.
+  const size_t n = prev.size();
+  const size_t ai = toIndex(a);
+  const auto mb_skill_index = skillIndex(a);
+
+  auto& after = *after_out;
+  auto& frames = *frames_out;
+  auto& dmg = *dmg_out;
+  auto& valid = *valid_out;
+  after = prev;
+  frames.assign(n, 0);
+  dmg.assign(n, 0);
+  valid.assign(n, 1);
+
+  auto hit = [&](size_t i) {
+    double d = 0;
+    after.set(i, applyHit<N, W, S>(after.get(i), a, &d));
+    dmg[i] += d;
+  };
+
+  // Repeated FS is not allowed, and cancelling FS with a skill is not
+  // allowed
+  if (a == Action::FS || mb_skill_index) {
+    for (size_t i = 0; i < n; i++) {
+      valid[i] = prev.afterAction_[i] != AfterAction::AFTER_FS;
     }
   }
 
-  // Compute damage
-  //  (NB: some units have to compute damage after skill effects;
-  //  e.g., Alfonse S1 and Serena. Be careful!)
-  {
-    double dmg = 5./3;
-    dmg *= config_->getAdventurer().getBaseStrength();
-    dmg *= (1. + config_->getAdventurer().getModifiers().getStrength());
-    dmg *= (1. + config_->getAdventurer().getCoabilityModifiers().getStrength());
-    // strength buffs here:
-    if (adventurerName() == AdventurerName::HEINWALD && after.buffFramesLeft_[1] > 0) {
-      dmg *= 1.2;
-    }
-    if (adventurerName() == AdventurerName::HEINWALD && after.buffFramesLeft_[0] > 0) {
-      dmg *= 1.2;
+  std::vector<frames_t> recovery(n);
+  std::vector<frames_t> hit_delay(n);
+  std::vector<frames_t> step(n);
+  for (size_t i = 0; i < n; i++) {
+    recovery[i] = params_.recoveryFrames_[toIndex(prev.afterAction_[i])][ai];
+    hit_delay[i] = hitDelay<W>(prev.afterAction_[i]);
+  }
+
+  // Apply delayed hits, if applicable
+  for (size_t i = 0; i < n; i++) {
+    if (valid[i] && hit_delay[i] > 0 && hit_delay[i] <= recovery[i]) hit(i);
+  }
+
+  // Wait for recovery
+  after.advanceFrames(recovery.data());
+  for (size_t i = 0; i < n; i++) {
+    frames[i] += recovery[i];
+  }
+
+  if (mb_skill_index) {
+    const size_t k = *mb_skill_index;
+    // Apply delay from UI
+    for (size_t i = 0; i < n; i++) {
+      step[i] = after.uiHiddenFramesLeft_[i];
+      frames[i] += step[i];
     }
-    if (adventurerName() == AdventurerName::AMANE && after.buffFramesLeft_[1] > 0) {
-      dmg *= 1.15;
+    after.advanceFrames(step.data());
+    const uint16_t cost = params_.skillSp_[k];
+    auto* sp = after.sp_[k].data();
+    for (size_t i = 0; i < n; i++) {
+      valid[i] &= sp[i] >= cost;
+      sp[i] = 0;
+      after.uiHiddenFramesLeft_[i] = params_.uiHiddenFrames_;
     }
-    if (adventurerName() == AdventurerName::AMANE && after.buffFramesLeft_[0] > 0) {
-      dmg *= 1.15;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (valid[i] && hit_delay[i] > recovery[i]) hit(i);
+  }
+
+  // Apply state machine change, and account for startup cost in UI
+  for (size_t i = 0; i < n; i++) {
+    size_t pi = toIndex(prev.afterAction_[i]);
+    after.afterAction_[i] = params_.next_[pi][ai];
+    step[i] = params_.startupFrames_[pi][ai];
+    frames[i] += step[i];
+  }
+  after.advanceFrames(step.data());
+
+  for (size_t i = 0; i < n; i++) {
+    if (valid[i] && hitDelay<W>(after.afterAction_[i]) == 0) hit(i);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (valid[i]) after.set(i, applySkillEffects<N>(after.get(i), a));
+  }
+
+  if (params_.timerBucket_ > 1) {
+    for (size_t i = 0; i < n; i++) {
+      after.set(i, roundTimers(after.get(i), params_));
     }
-    if (adventurerName() == AdventurerName::ANNELIE && after.buffFramesLeft_[0] > 0) {
-      dmg *= 1.20;
+  }
+  if (params_.spTolerance_ > 0) {
+    for (size_t i = 0; i < n; i++) {
+      after.set(i, roundSp(after.get(i), params_));
     }
-    // modifier
-    if (adventurerName() == AdventurerName::ANNELIE && after.afterAction_ == AfterAction::AFTER_S1) {
-      switch (after.skillShift_[0]) {
-        case 0:
-          dmg *= .1 + 8.14;
-          break;
-        case 1:
-          dmg *= .1 * 2 + 2 * 4.07;
-          break;
-        case 2:
-          dmg *= .1 * 3 + 3 * 3.54;
-          break;
-        default:
-          KJ_ASSERT(0, after.skillShift_[0]);
-      }
-    } else if (adventurerName() == AdventurerName::YACHIYO && after.afterAction_ == AfterAction::AFTER_FS && after.fsBuff_) {
-      dmg *= 7.82;
-    } else if (adventurerName() == AdventurerName::YACHIYO && after.afterAction_ == AfterAction::AFTER_S1 && after.afflictionFramesLeft_ == 0) {
-      // TODO: Assume para procs on first hit (then you get paralysis
-      // buff)
-      dmg *= 4.32 * 2;
+  }
+}
+
+template <AdventurerName N>
+AdventurerState Simulator::applySkillEffects(AdventurerState after, Action a) {
+  constexpr const EffectTable& E = EFFECTS<N>;
+  auto mb_skill_index = skillIndex(a);
+  if (!mb_skill_index) return after;
+  for (const auto& e : E.onSkill_[*mb_skill_index]) {
+    after = applyEffect(after, e);
+  }
+  if (a == Action::S3 && params_.s3BuffFrames_) {
+    after.buffFramesLeft_[2] = params_.s3BuffFrames_;
+  }
+  return after;
+}
+
+template <AdventurerName N, WeaponType W, size_t S>
+AdventurerState Simulator::applyHit(AdventurerState after, Action a, double* dmg_out) {
+  constexpr const EffectTable& E = EFFECTS<N>;
+  const auto mb_after_skill = afterSkillIndex(after.afterAction_);
+
+  // Apply skill SP change
+  for (size_t i = 0; i < S; i++) {
+    uint16_t new_sp = after.sp_[i] + params_.hitSp_[toIndex(after.afterAction_)];
+    if (new_sp > params_.skillSp_[i]) {
+      after.sp_[i] = params_.skillSp_[i];
     } else {
-      dmg *= afterActionDmg(after.afterAction_) / 100.;
-    }
-    if (skillIndex(a)) {
-      dmg *= (1. + config_->getAdventurer().getModifiers().getSkillDmg());
-      dmg *= (1. + config_->getAdventurer().getCoabilityModifiers().getSkillDmg());
-      // skill dmg buffs here:
-      // (none)
-    } else if (a == Action::FS) {
-      dmg *= (1. + config_->getAdventurer().getModifiers().getFsDmg());
-    }
-    dmg /= 10.;
-    double crit_rate = config_->getAdventurer().getModifiers().getCritRate()
-      + config_->getAdventurer().getCoabilityModifiers().getCritRate();
-    double crit_dmg = config_->getAdventurer().getModifiers().getCritDmg() + 0.7;
-    // crit buffs here:
-    if (config_->getWeapon().getName() == WeaponName::AXE5B1 &&
-        after.buffFramesLeft_[2] > 0) {
-      crit_dmg += 0.50;
-    }
-    // punisher
-    if (adventurerName() == AdventurerName::YACHIYO && after.afflictionFramesLeft_ > 0) {
-      dmg *= 1.2;  // paralyzed punisher
-    }
-    // energy
-    if (after.energy_ == 5) {
-      dmg *= 1.5;
-      // don't adjust here, we'll handle below
-    }
-    dmg *= 1 + crit_rate * crit_dmg;
-    dmg *= 1.5;
-    /*
-    // ODPS
-    if (after.afterAction_ == AfterAction::AFTER_FS) {
-      // NB: Need to handle Yachiyo adjustment here
-      dmg *= 4;
+      after.sp_[i] = new_sp;
     }
-    */
-    if (dmg_out) *dmg_out += dmg;
   }
 
+  // Compute damage
+  if (dmg_out) *dmg_out += params_.hitDmgTable_[dmgKey(params_, after, a)];
+
   // Apply skill state change
-  switch (adventurerName()) {
-    case AdventurerName::ANNELIE:
-      {
-        auto prev_energy = after.energy_;
-        if (after.energy_ == 5) {
-          after.energy_ = 0;
-        } else {
-          if (after.afterAction_ == AfterAction::AFTER_S1) {
-            if (after.skillShift_[0] == 0) {
-              after.energy_ = std::min(after.energy_ + 1, 5);
-            } else if (after.skillShift_[0] == 1) {
-              after.energy_ = std::min(after.energy_ + 2, 5);
-            }
-          } else if (after.afterAction_ == AfterAction::AFTER_S2) {
-            after.energy_ = std::min(after.energy_ + 2, 5);
-          }
-        }
-        if (after.afterAction_ == AfterAction::AFTER_S1) {
-          if (after.skillShift_[0] == 0) {
-            after.skillShift_[0] = 1;
-          } else if (after.skillShift_[0] == 1) {
-            after.skillShift_[0] = 2;
-          } else {
-            after.skillShift_[0] = 0;
-          }
-        }
-        // Energized: Strength +20% for 15s
-        if (after.energy_ == 5 && prev_energy != 5) {
-          after.buffFramesLeft_[0] = 15 * 60;
-        }
-      }
-      break;
-    case AdventurerName::YACHIYO:
-      // NB: Assuming that the 5s is never relevant
-      after = buffAllowDoubleStack(after, 10 * 60);
-      after.afflictionFramesLeft_ = 13 * 60;
-      break;
-    default:
-      break;
+  if (E.energyMax_) {
+    auto prev_energy = after.energy_;
+    if (after.energy_ == E.energyMax_) {
+      after.energy_ = 0;
+    } else if (mb_after_skill) {
+      size_t shift = *mb_after_skill < 2 ? after.skillShift_[*mb_after_skill] : 0;
+      after.energy_ = std::min<int>(
+          after.energy_ + E.energyGain_[*mb_after_skill][shift], E.energyMax_);
+    }
+    if (after.energy_ == E.energyMax_ && prev_energy != E.energyMax_) {
+      after.buffFramesLeft_[E.energizedBuffSlot_] = E.energizedBuffFrames_;
+    }
+  }
+  if (mb_after_skill && *mb_after_skill < 2 && E.skillShiftCycle_[*mb_after_skill]) {
+    auto& shift = after.skillShift_[*mb_after_skill];
+    shift = (shift + 1) % E.skillShiftCycle_[*mb_after_skill];
+  }
+  for (const auto& e : E.onHit_) {
+    after = applyEffect(after, e);
   }
 
   // Remove FS buff if necessary
@@ -427,36 +687,77 @@ AdventurerState Simulator::applyHit(AdventurerState after, Action a, double* dmg
   return after;
 }
 
+std::optional<AdventurerState> Simulator::applyFragment(
+    AdventurerState prev, ActionFragment f, frames_t* frames_out, double* dmg_out) {
+  std::optional<AdventurerState> st = prev;
+  frames_t total_frames = 0;
+  double total_dmg = 0;
+  forEachAction(f, [&](Action a) {
+    if (!st) return;
+    frames_t frames;
+    double dmg;
+    st = applyAction(*st, a, &frames, &dmg);
+    // frames and dmg are unspecified if the step failed
+    if (!st) return;
+    total_frames += frames;
+    total_dmg += dmg;
+  });
+  if (!st) return std::nullopt;
+  if (frames_out) *frames_out = total_frames;
+  if (dmg_out) *dmg_out = total_dmg;
+  return st;
+}
+
+void Simulator::applyFragmentBatch(
+    const AdventurerStateBatch& prev, ActionFragment f, AdventurerStateBatch* after_out,
+    std::vector<frames_t>* frames_out, std::vector<double>* dmg_out,
+    std::vector<uint8_t>* valid_out) {
+  size_t n = prev.size();
+  *after_out = prev;
+  frames_out->assign(n, 0);
+  dmg_out->assign(n, 0);
+  valid_out->assign(n, 1);
+  AdventurerStateBatch next;
+  std::vector<frames_t> frames;
+  std::vector<double> dmg;
+  std::vector<uint8_t> valid;
+  forEachAction(f, [&](Action a) {
+    applyActionBatch(*after_out, a, &next, &frames, &dmg, &valid);
+    for (size_t i = 0; i < n; i++) {
+      if (!(*valid_out)[i] || !valid[i]) {
+        // Keep the last legal state, so later actions never see an
+        // unspecified one
+        (*valid_out)[i] = 0;
+        next.set(i, after_out->get(i));
+        continue;
+      }
+      (*frames_out)[i] += frames[i];
+      (*dmg_out)[i] += dmg[i];
+    }
+    std::swap(*after_out, next);
+  });
+}
+
 AdventurerState Simulator::applyPrep(AdventurerState prev, std::optional<uint8_t> mb_prep) {
   AdventurerState after = prev;
-  uint8_t prep = mb_prep.value_or(getSkillPrep(adventurerName()));
+  uint8_t prep = mb_prep.value_or(params_.skillPrep_);
   KJ_LOG(INFO, prep, "skill prep");
-  for (size_t i = 0; i < getNumSkills(); i++) {
+  for (size_t i = 0; i < params_.numSkills_; i++) {
     // NB: Rounds down
-    after.sp_[i] = getSkillStat(i).getSp() * prep / 100;
+    after.sp_[i] = params_.skillSp_[i] * prep / 100;
   }
   return after;
 }
 
+template <WeaponType W>
 frames_t Simulator::hitDelay(AfterAction after) {
-  switch (after) {
-    case AfterAction::AFTER_C1:
-    case AfterAction::AFTER_C2:
-    case AfterAction::AFTER_C3:
-    case AfterAction::AFTER_C4:
-    case AfterAction::AFTER_C5:
-    case AfterAction::AFTER_FS:
-      switch (config_->getWeapon().getWtype()) {
-        case WeaponType::STAFF:
-        case WeaponType::WAND:
-        case WeaponType::BOW:
-          // TODO: Handle Bow FS
-          return projectile_delay_;
-        default:
-          return 0;
-      }
-    // TODO: Some skills have delays
+  switch (W) {
+    case WeaponType::STAFF:
+    case WeaponType::WAND:
+    case WeaponType::BOW:
+      return params_.hitDelay_[toIndex(after)];
     default:
+      // Melee hits land immediately
       return 0;
   }
 }
@@ -1,18 +1,91 @@
 #pragma once
 
+#include <dlgrind/action_string.h>
 #include <dlgrind/schema.capnp.h>
 #include <dlgrind/state.h>
 
 #include <kj/debug.h>
 
+#include <array>
 #include <memory>
 #include <optional>
 #include <unordered_map>
+#include <utility>
 
 #include <capnp/serialize.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+// Which way the approximations round: buff timers to their bucket,
+// and SP near a skill's cost to its tolerance (see
+// Simulator::setTimerBucket and setSpTolerance)
+enum class ApproxRounding : uint8_t {
+  // Down: buffs run out and skills charge late, so the damage of a
+  // rotation is a lower bound
+  CONSERVATIVE,
+  // Up: they last longer and charge early; an upper bound
+  OPTIMISTIC,
+};
+
+// Everything the simulator needs from the Config, flattened (and
+// with constant factors folded) whenever the config or a setting
+// that affects it changes.  The hot path reads only from here and
+// never chases capnp pointers.
+struct SimParams {
+  AdventurerName adventurer_ = AdventurerName::ERIK;
+  WeaponType weaponType_ = WeaponType::AXE;
+  size_t numSkills_ = 0;
+  // SP cost of each skill
+  std::array<uint16_t, 3> skillSp_ = {};
+  // SP gained (by each skill) when the hit that leads to this state
+  // lands, including skill haste
+  std::array<uint16_t, NUM_AFTER_ACTIONS> hitSp_ = {};
+  // Damage modifier of the hit that leads to this state (mod / 100)
+  std::array<double, NUM_AFTER_ACTIONS> hitDmg_ = {};
+  // Frames between this state being reached and its hit landing
+  std::array<frames_t, NUM_AFTER_ACTIONS> hitDelay_ = {};
+  // [prev][a]: state reached by doing a
+  std::array<std::array<AfterAction, NUM_ACTIONS>, NUM_AFTER_ACTIONS> next_ = {};
+  // [prev][a]: recovery of prev we must wait for before a (after
+  // cancels)
+  std::array<std::array<frames_t, NUM_ACTIONS>, NUM_AFTER_ACTIONS> recoveryFrames_ = {};
+  // [prev][a]: startup of a (which may depend on prev; e.g. XFS)
+  std::array<std::array<frames_t, NUM_ACTIONS>, NUM_AFTER_ACTIONS> startupFrames_ = {};
+  frames_t uiHiddenFrames_ = 0;
+  // Crit damage buff granted by S3 (0 if none); lives in buff slot 2
+  frames_t s3BuffFrames_ = 0;
+  // 5/3 * base strength * (1 + strength) * (1 + coability strength)
+  double strength_ = 0;
+  // (1 + skill dmg) * (1 + coability skill dmg)
+  double skillDmg_ = 0;
+  // 1 + fs dmg
+  double fsDmg_ = 0;
+  // (1 + crit rate * crit dmg) * 1.5 / 10, indexed by whether the S3
+  // crit damage buff is active
+  std::array<double, 2> critFactor_ = {};
+  uint8_t skillPrep_ = 0;  // default, percentage
+  uint8_t energyMax_ = 0;  // 0 if the adventurer has no energy
+  // Buff timers are kept at multiples of this after every action (1:
+  // exact)
+  frames_t timerBucket_ = 1;
+  // Length of the shortest action (of any legal one, and then some)
+  frames_t minActionFrames_ = 0;
+  ApproxRounding rounding_ = ApproxRounding::CONSERVATIVE;
+  // SP within this much of a skill's cost is all one value after
+  // every action (0: exact)
+  uint16_t spTolerance_ = 0;
+  // Least SP any hit gains (0 if none does)
+  uint16_t minHitSp_ = 0;
+
+  // Damage of a hit, indexed by everything it depends on besides the
+  // config: (afterAction, class of the action being taken (X, FS or
+  // skill), which buff slots are active (bitmask), energy == max,
+  // skill shift of the skill hitting, fsBuff, afflicted), in
+  // row-major order.
+  static constexpr size_t DMG_TABLE_SIZE = NUM_AFTER_ACTIONS * 3 * 8 * 2 * 3 * 2 * 2;
+  std::array<double, DMG_TABLE_SIZE> hitDmgTable_ = {};
+};
+
 class Simulator {
 public:
   std::optional<AdventurerState> applyAction(
@@ -20,6 +93,41 @@ public:
       Action a,
       frames_t* frames_out = nullptr,
       double* dmg_out = nullptr
+      ) {
+    return (this->*kernels_.applyAction_)(prev, a, frames_out, dmg_out);
+  }
+
+  // applyAction on every state of a batch.  Outputs are resized to
+  // the size of the batch.  valid_out[i] is 0 if a is illegal in
+  // state i, in which case the other outputs for i are unspecified.
+  void applyActionBatch(
+      const AdventurerStateBatch& prev,
+      Action a,
+      AdventurerStateBatch* after_out,
+      std::vector<frames_t>* frames_out,
+      std::vector<double>* dmg_out,
+      std::vector<uint8_t>* valid_out
+      ) {
+    (this->*kernels_.applyActionBatch_)(prev, a, after_out, frames_out, dmg_out, valid_out);
+  }
+
+  // The actions of a whole fragment (e.g., c3fs) in turn, with their
+  // frames and damage summed.  nullopt if any of them is illegal.
+  std::optional<AdventurerState> applyFragment(
+      AdventurerState prev,
+      ActionFragment f,
+      frames_t* frames_out = nullptr,
+      double* dmg_out = nullptr
+      );
+
+  // applyFragment on every state of a batch, as applyActionBatch
+  void applyFragmentBatch(
+      const AdventurerStateBatch& prev,
+      ActionFragment f,
+      AdventurerStateBatch* after_out,
+      std::vector<frames_t>* frames_out,
+      std::vector<double>* dmg_out,
+      std::vector<uint8_t>* valid_out
       );
 
   AdventurerState applyPrep(
@@ -36,34 +144,136 @@ public:
 
   void setConfig(kj::Own<Config::Reader> config) {
     config_ = std::move(config);
+    refreshParams();
+    selectKernels();
   }
 
   void setProjectileDelay(frames_t frames) {
     projectile_delay_ = frames;
+    if (config_.get()) refreshParams();
   }
 
   void setNumSkills(size_t num_skills) {
+    KJ_REQUIRE(num_skills >= 1 && num_skills <= 3, num_skills);
     num_skills_ = num_skills;
+    if (config_.get()) {
+      refreshParams();
+      selectKernels();
+    }
+  }
+
+  // Approximate: only track buff timers to multiples of bucket
+  // frames.  Only whether a buff is running matters for damage, so
+  // this mostly costs precision at the edges of buffs, and shrinks the
+  // state space by about a factor of bucket per buff.
+  //
+  // Timers are rounded again after every action, so each action may
+  // count down up to bucket - 1 frames too many (conservative) or too
+  // few (optimistic), and the error adds up over a buff.  The bucket
+  // may be no longer than the shortest action, so an optimistic timer
+  // still runs out.  Rounding is monotone and buffs only ever help, so
+  // a conservative and an optimistic run bracket the exact optimum.
+  // Afflictions are kept exact: they turn damage both on (punishers)
+  // and off (e.g., Yachiyo's S1), so rounding them would not bound
+  // anything.
+  void setTimerBucket(frames_t bucket) {
+    KJ_REQUIRE(bucket >= 1, bucket);
+    timer_bucket_ = bucket;
+    if (config_.get()) refreshParams();
+  }
+
+  // For both setTimerBucket and setSpTolerance
+  void setApproxRounding(ApproxRounding rounding) {
+    approx_rounding_ = rounding;
+    if (config_.get()) refreshParams();
+  }
+
+  // Approximate: treat SP that is at most tolerance short of a
+  // skill's cost as a single value; conservatively tolerance short,
+  // optimistically the cost itself (the skill is ready).  States
+  // that only differ there are merged as they are discovered.  More
+  // SP only ever allows more, so as with timers a conservative and an
+  // optimistic run bracket the exact optimum.  The tolerance may be no more than the smallest hit
+  // gains: otherwise a conservative skill could be rounded back into
+  // the window after every hit and never charge.
+  void setSpTolerance(uint16_t tolerance) {
+    sp_tolerance_ = tolerance;
+    if (config_.get()) refreshParams();
+  }
+
+  // Whether rotations are only simulated approximately
+  bool approximate() const {
+    return params_.timerBucket_ > 1 || params_.spTolerance_ > 0;
   }
 
+  const SimParams& params() const { return params_; }
+
+  // Packing of the states reachable under the current config
+  const StateLayout& layout() const { return layout_; }
+
 private:
+  using ApplyActionFn = std::optional<AdventurerState> (Simulator::*)(
+      AdventurerState, Action, frames_t*, double*);
+  using ApplyActionBatchFn = void (Simulator::*)(
+      const AdventurerStateBatch&, Action, AdventurerStateBatch*,
+      std::vector<frames_t>*, std::vector<double>*, std::vector<uint8_t>*);
+
+  struct Kernels {
+    ApplyActionFn applyAction_ = nullptr;
+    ApplyActionBatchFn applyActionBatch_ = nullptr;
+  };
+
+  // The hot path is specialized on everything that is fixed for a
+  // config and that it would otherwise branch on for every call: the
+  // adventurer, the weapon type and the number of skills.  We pick
+  // the specialization once, when the config changes.
+  void selectKernels();
+
+  // Recompute params_ from config_ and the settings
+  void refreshParams();
+
+  template <size_t... I>
+  static Kernels kernelsFor(size_t i, std::index_sequence<I...>);
+
+  template <AdventurerName N, WeaponType W, size_t S>
+  std::optional<AdventurerState> applyActionImpl(
+      AdventurerState prev, Action a, frames_t* frames_out, double* dmg_out);
+
+  template <AdventurerName N, WeaponType W, size_t S>
+  void applyActionBatchImpl(
+      const AdventurerStateBatch& prev, Action a, AdventurerStateBatch* after_out,
+      std::vector<frames_t>* frames_out, std::vector<double>* dmg_out,
+      std::vector<uint8_t>* valid_out);
+
+  template <AdventurerName N, WeaponType W, size_t S>
+  AdventurerState applyHit(AdventurerState, Action, double* dmg_out);
+
+  template <AdventurerName N>
+  AdventurerState applySkillEffects(AdventurerState, Action);
+
+  template <WeaponType W>
+  frames_t hitDelay(AfterAction after);
+
   ActionStat::Reader getComboStat(size_t i);
   ActionStat::Reader getSkillStat(size_t i);
   size_t getNumSkills();
   uint32_t afterActionSp(AfterAction after);
   double afterActionDmg(AfterAction after);
-  frames_t hitDelay(AfterAction after);
 
   AdventurerName adventurerName() { return config_->getAdventurer().getName(); }
 
-  AdventurerState applyHit(AdventurerState, Action, double* dmg_out);
-
   frames_t prevRecoveryFrames(AfterAction prev, Action a);
   frames_t afterStartupFrames(AfterAction prev, Action a, AfterAction after);
 
   kj::Own<Config::Reader> config_;
+  SimParams params_;
+  StateLayout layout_;
+  Kernels kernels_;
 
   std::optional<size_t> num_skills_;
   frames_t ui_hidden_frames_ = 114;
   frames_t projectile_delay_ = 50;  // default to precharge computation
+  frames_t timer_bucket_ = 1;
+  ApproxRounding approx_rounding_ = ApproxRounding::CONSERVATIVE;
+  uint16_t sp_tolerance_ = 0;
 };
@@ -1 +1,89 @@
 #include <dlgrind/state.h>
+
+#include <kj/debug.h>
+
+static uint32_t getField(const AdventurerState& st, StateField f) {
+  switch (f) {
+    case StateField::AFTER_ACTION: return toIndex(st.afterAction_);
+    case StateField::UI_HIDDEN: return st.uiHiddenFramesLeft_;
+    case StateField::ENERGY: return st.energy_;
+    case StateField::SKILL_SHIFT0: return st.skillShift_[0];
+    case StateField::SKILL_SHIFT1: return st.skillShift_[1];
+    case StateField::SP0: return st.sp_[0];
+    case StateField::SP1: return st.sp_[1];
+    case StateField::SP2: return st.sp_[2];
+    case StateField::BUFF0: return st.buffFramesLeft_[0];
+    case StateField::BUFF1: return st.buffFramesLeft_[1];
+    case StateField::BUFF2: return st.buffFramesLeft_[2];
+    case StateField::FS_BUFF: return st.fsBuff_;
+    case StateField::AFFLICTION: return st.afflictionFramesLeft_;
+  }
+  KJ_UNREACHABLE;
+}
+
+static void setField(AdventurerState* st, StateField f, uint32_t v) {
+  switch (f) {
+    case StateField::AFTER_ACTION: st->afterAction_ = static_cast<AfterAction>(v); break;
+    case StateField::UI_HIDDEN: st->uiHiddenFramesLeft_ = v; break;
+    case StateField::ENERGY: st->energy_ = v; break;
+    case StateField::SKILL_SHIFT0: st->skillShift_[0] = v; break;
+    case StateField::SKILL_SHIFT1: st->skillShift_[1] = v; break;
+    case StateField::SP0: st->sp_[0] = v; break;
+    case StateField::SP1: st->sp_[1] = v; break;
+    case StateField::SP2: st->sp_[2] = v; break;
+    case StateField::BUFF0: st->buffFramesLeft_[0] = v; break;
+    case StateField::BUFF1: st->buffFramesLeft_[1] = v; break;
+    case StateField::BUFF2: st->buffFramesLeft_[2] = v; break;
+    case StateField::FS_BUFF: st->fsBuff_ = v; break;
+    case StateField::AFFLICTION: st->afflictionFramesLeft_ = v; break;
+  }
+}
+
+StateLayout::StateLayout(const StateFieldMax& max) {
+  // First fit, without letting a field straddle the two words
+  uint8_t used[2] = {0, 0};
+  for (size_t f = 0; f < NUM_STATE_FIELDS; f++) {
+    uint8_t width = 0;
+    while (width < 32 && (max[f] >> width) != 0) width++;
+    auto& slot = slots_[f];
+    slot.width_ = width;
+    if (width == 0) continue;
+    size_t w = used[0] + width <= 64 ? 0 : 1;
+    KJ_REQUIRE(used[w] + width <= 64, f, width, "state does not fit in a PackedState");
+    slot.word_ = w;
+    slot.shift_ = used[w];
+    used[w] += width;
+    bits_ += width;
+  }
+}
+
+PackedState StateLayout::pack(const AdventurerState& st) const {
+  PackedState r;
+  for (size_t f = 0; f < NUM_STATE_FIELDS; f++) {
+    const auto& slot = slots_[f];
+    uint64_t v = getField(st, static_cast<StateField>(f));
+    KJ_DASSERT(slot.width_ == 64 || v >> slot.width_ == 0, f, v, "field out of range");
+    if (slot.width_ == 0) continue;
+    r.words_[slot.word_] |= v << slot.shift_;
+  }
+  return r;
+}
+
+bool StateLayout::fits(const AdventurerState& st) const {
+  for (size_t f = 0; f < NUM_STATE_FIELDS; f++) {
+    uint64_t v = getField(st, static_cast<StateField>(f));
+    if (v >> slots_[f].width_ != 0) return false;
+  }
+  return true;
+}
+
+AdventurerState StateLayout::unpack(const PackedState& packed) const {
+  AdventurerState st;
+  for (size_t f = 0; f < NUM_STATE_FIELDS; f++) {
+    const auto& slot = slots_[f];
+    if (slot.width_ == 0) continue;
+    uint64_t mask = (uint64_t(1) << slot.width_) - 1;
+    setField(&st, static_cast<StateField>(f), (packed.words_[slot.word_] >> slot.shift_) & mask);
+  }
+  return st;
+}
@@ -4,12 +4,22 @@
 
 #include <magic_enum.h>
 
+#include <algorithm>
+#include <array>
 #include <memory>
 #include <optional>
 #include <unordered_map>
+#include <vector>
 
 using frames_t = uint32_t;
 
+constexpr size_t NUM_ACTIONS = 5;
+constexpr size_t NUM_AFTER_ACTIONS = 10;
+
+// For tables indexed by the raw enum values
+inline size_t toIndex(Action a) { return static_cast<size_t>(a); }
+inline size_t toIndex(AfterAction a) { return static_cast<size_t>(a); }
+
 inline frames_t sub_floor_zero(frames_t a, frames_t b) {
   if (b > a) return 0;
   return a - b;
@@ -54,6 +64,78 @@ struct AdventurerState {
   }
 };
 
+// Structure-of-arrays layout for a batch of AdventurerStates, for
+// Simulator::applyActionBatch.  Field meanings are the same as in
+// AdventurerState.
+struct AdventurerStateBatch {
+  std::vector<AfterAction> afterAction_;
+  std::vector<uint8_t> uiHiddenFramesLeft_;
+  std::vector<uint8_t> energy_;
+  std::array<std::vector<uint8_t>, 2> skillShift_;
+  std::array<std::vector<uint16_t>, 3> sp_;
+  std::array<std::vector<uint16_t>, 3> buffFramesLeft_;
+  std::vector<uint8_t> fsBuff_;
+  std::vector<uint16_t> afflictionFramesLeft_;
+
+  size_t size() const { return afterAction_.size(); }
+
+  void resize(size_t n) {
+    afterAction_.resize(n);
+    uiHiddenFramesLeft_.resize(n);
+    energy_.resize(n);
+    for (auto& v : skillShift_) v.resize(n);
+    for (auto& v : sp_) v.resize(n);
+    for (auto& v : buffFramesLeft_) v.resize(n);
+    fsBuff_.resize(n);
+    afflictionFramesLeft_.resize(n);
+  }
+
+  AdventurerState get(size_t i) const {
+    AdventurerState st;
+    st.afterAction_ = afterAction_[i];
+    st.uiHiddenFramesLeft_ = uiHiddenFramesLeft_[i];
+    st.energy_ = energy_[i];
+    for (size_t k = 0; k < 2; k++) st.skillShift_[k] = skillShift_[k][i];
+    for (size_t k = 0; k < 3; k++) st.sp_[k] = sp_[k][i];
+    for (size_t k = 0; k < 3; k++) st.buffFramesLeft_[k] = buffFramesLeft_[k][i];
+    st.fsBuff_ = fsBuff_[i];
+    st.afflictionFramesLeft_ = afflictionFramesLeft_[i];
+    return st;
+  }
+
+  void set(size_t i, const AdventurerState& st) {
+    afterAction_[i] = st.afterAction_;
+    uiHiddenFramesLeft_[i] = st.uiHiddenFramesLeft_;
+    energy_[i] = st.energy_;
+    for (size_t k = 0; k < 2; k++) skillShift_[k][i] = st.skillShift_[k];
+    for (size_t k = 0; k < 3; k++) sp_[k][i] = st.sp_[k];
+    for (size_t k = 0; k < 3; k++) buffFramesLeft_[k][i] = st.buffFramesLeft_[k];
+    fsBuff_[i] = st.fsBuff_;
+    afflictionFramesLeft_[i] = st.afflictionFramesLeft_;
+  }
+
+  // Saturating advanceFrames on every state.  Written as one
+  // straight loop per field so that it vectorizes.
+  void advanceFrames(const frames_t* frames) {
+    size_t n = size();
+    auto sub = [](auto a, frames_t b) -> decltype(a) {
+      return a - std::min<frames_t>(a, b);
+    };
+    for (size_t i = 0; i < n; i++) {
+      uiHiddenFramesLeft_[i] = sub(uiHiddenFramesLeft_[i], frames[i]);
+    }
+    for (size_t k = 0; k < 3; k++) {
+      auto* buff = buffFramesLeft_[k].data();
+      for (size_t i = 0; i < n; i++) {
+        buff[i] = sub(buff[i], frames[i]);
+      }
+    }
+    for (size_t i = 0; i < n; i++) {
+      afflictionFramesLeft_[i] = sub(afflictionFramesLeft_[i], frames[i]);
+    }
+  }
+};
+
 inline uint KJ_HASHCODE(const AdventurerState& st) {
   return kj::hashCode(
       static_cast<uint>(st.afterAction_),
@@ -83,3 +165,80 @@ struct AdventurerStateHasher {
 template <typename T>
 using AdventurerStateMap = std::unordered_map<AdventurerState, T, AdventurerStateHasher>;
 
+// Compact encoding of AdventurerState.
+//
+// AdventurerState has room for every field any adventurer uses, but
+// a given config only touches a few of them (and only over a small
+// range; e.g., SP never exceeds the skill cost.)  StateLayout
+// assigns each field just enough bits for its range, so a state
+// usually packs into well under 128 bits, and unused fields take no
+// space at all.
+
+enum class StateField : uint8_t {
+  AFTER_ACTION,
+  UI_HIDDEN,
+  ENERGY,
+  SKILL_SHIFT0,
+  SKILL_SHIFT1,
+  SP0,
+  SP1,
+  SP2,
+  BUFF0,
+  BUFF1,
+  BUFF2,
+  FS_BUFF,
+  AFFLICTION,
+};
+
+constexpr size_t NUM_STATE_FIELDS = 13;
+
+using StateFieldMax = std::array<uint32_t, NUM_STATE_FIELDS>;
+
+struct PackedState {
+  std::array<uint64_t, 2> words_ = {0, 0};
+
+  bool operator==(const PackedState& other) const { return words_ == other.words_; }
+  bool operator!=(const PackedState& other) const { return words_ != other.words_; }
+};
+
+struct PackedStateHasher {
+  std::size_t operator()(const PackedState& st) const {
+    // splitmix64 finalizer over both words
+    uint64_t h = st.words_[0] ^ (st.words_[1] * 0x9e3779b97f4a7c15ULL);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+  }
+};
+
+template <typename T>
+using PackedStateMap = std::unordered_map<PackedState, T, PackedStateHasher>;
+
+class StateLayout {
+public:
+  StateLayout() {}
+  explicit StateLayout(const StateFieldMax& max);
+
+  // st must fit (pack only checks in debug builds)
+  PackedState pack(const AdventurerState& st) const;
+  AdventurerState unpack(const PackedState& packed) const;
+
+  // Whether every field of st is within its slot's width; states from
+  // outside the simulator (e.g., typed in mid-fight) may not be, and
+  // packing them would spill into the neighbouring fields
+  bool fits(const AdventurerState& st) const;
+
+  // Total number of bits used
+  uint32_t bits() const { return bits_; }
+
+private:
+  struct Slot {
+    uint8_t word_ = 0;
+    uint8_t shift_ = 0;
+    uint8_t width_ = 0;
+  };
+
+  std::array<Slot, NUM_STATE_FIELDS> slots_ = {};
+  uint32_t bits_ = 0;
+};
+
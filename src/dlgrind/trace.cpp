@@ -0,0 +1,73 @@
+#include <dlgrind/trace.h>
+
+#include <kj/debug.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+
+Tracer& Tracer::global() {
+  static Tracer tracer;
+  return tracer;
+}
+
+uint64_t Tracer::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TraceBuffer& Tracer::threadBuffer() {
+  // NB: keyed on the tracer too, in case someone makes a second one
+  thread_local Tracer* owner = nullptr;
+  thread_local TraceBuffer* buffer = nullptr;
+  if (owner != this) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers_.emplace_back(std::make_unique<TraceBuffer>(buffers_.size()));
+    buffer = buffers_.back().get();
+    owner = this;
+  }
+  return *buffer;
+}
+
+void Tracer::record(const char* name, uint64_t begin_ns, uint64_t end_ns, int64_t arg) {
+  threadBuffer().record({name, begin_ns, end_ns, arg});
+}
+
+void Tracer::writeChromeTrace(std::ostream& os) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto us = [&](uint64_t ns) {
+    return static_cast<double>(ns - std::min(ns, epoch_ns_)) / 1000.;
+  };
+  auto flags = os.flags();
+  auto precision = os.precision();
+  os << std::fixed << std::setprecision(3);
+  os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  bool first = true;
+  auto sep = [&]() {
+    if (!first) os << ",\n";
+    first = false;
+  };
+  for (const auto& buffer : buffers_) {
+    sep();
+    os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid()
+       << ",\"args\":{\"name\":\"thread " << buffer->tid() << "\"}}";
+    uint64_t size = buffer->size();
+    uint64_t begin = size > TraceBuffer::CAPACITY ? size - TraceBuffer::CAPACITY : 0;
+    if (begin > 0) {
+      KJ_LOG(WARNING, buffer->tid(), begin, "trace events dropped (ring buffer full)");
+    }
+    for (uint64_t i = begin; i < size; i++) {
+      const auto& e = buffer->get(i);
+      sep();
+      os << "{\"name\":\"" << e.name_ << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid()
+         << ",\"ts\":" << us(e.begin_ns_) << ",\"dur\":" << us(e.end_ns_) - us(e.begin_ns_);
+      if (e.arg_ >= 0) {
+        os << ",\"args\":{\"arg\":" << e.arg_ << "}";
+      }
+      os << "}";
+    }
+  }
+  os << "\n]}\n";
+  os.flags(flags);
+  os.precision(precision);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <kj/common.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Lightweight execution tracing.
+//
+// Spans are recorded into a per-thread ring buffer.  Only the owning
+// thread writes to its ring, so recording a span is a couple of
+// clock reads and a store; the only lock is taken the first time a
+// thread records anything.  The rings are read when the trace is
+// dumped, which must happen after traced threads have quiesced.
+//
+// The dump is in Chrome's trace-event format; load it in
+// chrome://tracing or https://ui.perfetto.dev
+
+struct TraceEvent {
+  const char* name_;  // must be a string literal
+  uint64_t begin_ns_;
+  uint64_t end_ns_;
+  int64_t arg_;  // -1 if none
+};
+
+class TraceBuffer {
+public:
+  // Power of two, so head_ can be reduced with a mask
+  static constexpr size_t CAPACITY = 1 << 16;
+
+  explicit TraceBuffer(int tid) : tid_(tid) {}
+
+  KJ_DISALLOW_COPY(TraceBuffer);
+
+  void record(const TraceEvent& event) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    events_[head & (CAPACITY - 1)] = event;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  int tid() const { return tid_; }
+  uint64_t size() const { return head_.load(std::memory_order_acquire); }
+  const TraceEvent& get(uint64_t i) const { return events_[i & (CAPACITY - 1)]; }
+
+private:
+  int tid_;
+  std::atomic<uint64_t> head_ = 0;
+  std::array<TraceEvent, CAPACITY> events_;
+};
+
+class Tracer {
+public:
+  static Tracer& global();
+
+  void setEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  static uint64_t now();
+
+  void record(const char* name, uint64_t begin_ns, uint64_t end_ns, int64_t arg);
+
+  void writeChromeTrace(std::ostream& os);
+
+private:
+  TraceBuffer& threadBuffer();
+
+  std::atomic<bool> enabled_ = false;
+  uint64_t epoch_ns_ = now();
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<TraceBuffer>> buffers_;
+};
+
+// Records a span from construction to destruction on the calling
+// thread.  Costs a relaxed load if tracing is disabled.
+class TraceSpan {
+public:
+  explicit TraceSpan(const char* name, int64_t arg = -1)
+      : name_(name), arg_(arg),
+        begin_ns_(Tracer::global().enabled() ? Tracer::now() : 0) {}
+
+  ~TraceSpan() {
+    if (begin_ns_) Tracer::global().record(name_, begin_ns_, Tracer::now(), arg_);
+  }
+
+  KJ_DISALLOW_COPY(TraceSpan);
+
+private:
+  const char* name_;
+  int64_t arg_;
+  uint64_t begin_ns_;
+};